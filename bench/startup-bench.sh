@@ -0,0 +1,95 @@
+#!/bin/sh
+#
+# Startup benchmark for rpcc, run by "meson test --benchmark" - see the README.
+#
+# Usage: startup-bench.sh RPCC STUB_PLUGIN METRICS_SCRIPT [OUTPUT]
+#
+# For each number of tabs in BENCH_TABS (default "5 50 500"), copies of the stub plugin,
+# each with RPCC_STUB_TABS tabs (default 5), are put in a directory of their own, and rpcc
+# is run against it twice - once with no plugin manifest (cold) and once with the manifest
+# written by the first run (warm). After BENCH_SETTLE seconds (default 3), BENCH_SWITCHES
+# tabs (default 10) are selected by running "rpcc <tab_id>", then rpcc is stopped with
+# SIGTERM, which writes its trace. The metrics from all the traces are written as JSON to
+# OUTPUT (default rpcc-bench.json) and to stdout.
+#
+# If there is no display, the benchmark is run under xvfb-run, or failing that on a GDK
+# broadway display; a private D-Bus session is started for it in either case.
+
+set -e
+
+if [ $# -lt 3 ] ; then
+    echo "Usage: $0 RPCC STUB_PLUGIN METRICS_SCRIPT [OUTPUT]" >&2
+    exit 1
+fi
+
+if [ -z "$BENCH_SESSION" ] ; then
+    export BENCH_SESSION=1
+    if command -v xvfb-run > /dev/null ; then
+        exec xvfb-run -a -s "-screen 0 1280x1024x24" dbus-run-session -- "$0" "$@"
+    elif command -v broadwayd > /dev/null ; then
+        broadwayd :42 > /dev/null 2>&1 &
+        broadway=$!
+        sleep 1
+        GDK_BACKEND=broadway BROADWAY_DISPLAY=:42 dbus-run-session -- "$0" "$@" && res=0 || res=$?
+        kill $broadway
+        exit $res
+    else
+        echo "Neither xvfb-run nor broadwayd is available" >&2
+        exit 77
+    fi
+fi
+
+rpcc=$(realpath "$1")
+stub=$(realpath "$2")
+metrics=$(realpath "$3")
+out=${4:-rpcc-bench.json}
+
+export RPCC_STUB_TABS=${RPCC_STUB_TABS:-5}
+sizes=${BENCH_TABS:-"5 50 500"}
+settle=${BENCH_SETTLE:-3}
+switches=${BENCH_SWITCHES:-10}
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+runs=""
+
+for size in $sizes ; do
+    nplugins=$(( (size + RPCC_STUB_TABS - 1) / RPCC_STUB_TABS ))
+    plugins="$work/plugins-$size"
+    mkdir -p "$plugins" "$work/cache-$size" "$work/config-$size"
+
+    # separate copies rather than links, so that each is loaded as a plugin of its own
+    i=1
+    while [ $i -le $nplugins ] ; do
+        cp "$stub" "$plugins/$(printf 'stub%03d' $i).so"
+        i=$((i + 1))
+    done
+
+    for pass in cold warm ; do
+        trace="$work/trace-$size-$pass.json"
+        RPCC_PLUGIN_PATH="$plugins/" RPCC_TRACE="$trace" XDG_CACHE_HOME="$work/cache-$size" \
+            XDG_CONFIG_HOME="$work/config-$size" "$rpcc" &
+        pid=$!
+        sleep "$settle"
+
+        # the running instance switches to the tab named on the command line of another
+        k=0
+        while [ $k -lt $switches ] ; do
+            id=$(printf 'stub%03d_%d' $((k % nplugins + 1)) $((k % RPCC_STUB_TABS)))
+            env -u RPCC_TRACE "$rpcc" "$id"
+            sleep 0.3
+            k=$((k + 1))
+        done
+
+        kill -TERM $pid
+        wait $pid || true
+        if [ ! -f "$trace" ] ; then
+            echo "rpcc did not write a trace for $size tabs ($pass)" >&2
+            exit 1
+        fi
+        runs="$runs $((nplugins * RPCC_STUB_TABS)) $pass $trace"
+    done
+done
+
+python3 "$metrics" $runs > "$out"
+cat "$out"
@@ -0,0 +1,177 @@
+/*============================================================================
+Copyright (c) 2024 Raspberry Pi
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of the copyright holder nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+============================================================================*/
+
+/* Stub plugin for the startup benchmark. Each copy of the built module is a separate
+ * plugin, named after its file, with RPCC_STUB_TABS tabs (5 by default), each of which
+ * is built from data/test.ui. */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <gtk/gtk.h>
+
+#include "rpcc.h"
+
+/*----------------------------------------------------------------------------*/
+/* Global data */
+/*----------------------------------------------------------------------------*/
+
+static int ntabs = 0;
+static char **names;
+static char **ids;
+
+/*----------------------------------------------------------------------------*/
+/* Function prototypes */
+/*----------------------------------------------------------------------------*/
+
+static void stub_setup (void);
+static void init_plugin (GtkWidget *);
+static int plugin_tabs (void);
+static const char *tab_name (int tab);
+static const char *tab_id (int tab);
+static const char *icon_name (int);
+static GtkWidget *get_tab (int);
+static void release_tab (int);
+static gboolean reboot_needed (void);
+static void free_plugin (void);
+
+/*----------------------------------------------------------------------------*/
+/* Plugin interface */
+/*----------------------------------------------------------------------------*/
+
+static const rpcc_plugin_t descriptor = {
+    .abi_version = RPCC_ABI_VERSION,
+    .size = sizeof (rpcc_plugin_t),
+    .flags = RPCC_PLUGIN_LAZY_TABS | RPCC_PLUGIN_RELEASE_TAB,
+    .init_plugin = init_plugin,
+    .plugin_tabs = plugin_tabs,
+    .tab_name = tab_name,
+    .tab_id = tab_id,
+    .icon_name = icon_name,
+    .get_tab = get_tab,
+    .reboot_needed = reboot_needed,
+    .free_plugin = free_plugin,
+    .release_tab = release_tab,
+};
+
+const rpcc_plugin_t *plugin_descriptor (void)
+{
+    return &descriptor;
+}
+
+/* Tab names and ids are taken from the name of the file, so that each copy is distinct */
+static void stub_setup (void)
+{
+    const char *env;
+    char *base;
+    Dl_info info;
+    int tab;
+
+    if (ntabs) return;
+
+    env = getenv ("RPCC_STUB_TABS");
+    ntabs = env ? atoi (env) : 5;
+    if (ntabs < 1) ntabs = 1;
+
+    if (dladdr (stub_setup, &info) && info.dli_fname) base = g_path_get_basename (info.dli_fname);
+    else base = g_strdup ("stub");
+    if (strchr (base, '.')) *strchr (base, '.') = 0;
+
+    names = g_new0 (char *, ntabs);
+    ids = g_new0 (char *, ntabs);
+    for (tab = 0; tab < ntabs; tab++)
+    {
+        names[tab] = g_strdup_printf ("%s %d", base, tab);
+        ids[tab] = g_strdup_printf ("%s_%d", base, tab);
+    }
+    g_free (base);
+}
+
+static void init_plugin (GtkWidget *)
+{
+    stub_setup ();
+}
+
+static int plugin_tabs (void)
+{
+    stub_setup ();
+    return ntabs;
+}
+
+static const char *tab_name (int tab)
+{
+    return names[tab];
+}
+
+static const char *tab_id (int tab)
+{
+    return ids[tab];
+}
+
+static const char *icon_name (int)
+{
+    return "preferences-system";
+}
+
+/* Every page is parsed from the file afresh, as a real plugin's would be */
+static GtkWidget *get_tab (int)
+{
+    GtkBuilder *builder;
+    GtkWidget *box, *wd;
+
+    builder = gtk_builder_new_from_file (STUB_UI);
+    box = (GtkWidget *) gtk_builder_get_object (builder, "contents");
+    wd = (GtkWidget *) gtk_builder_get_object (builder, "dummy_wd");
+    g_object_ref (box);
+    gtk_container_remove (GTK_CONTAINER (wd), box);
+    g_object_force_floating (G_OBJECT (box));
+    gtk_widget_destroy (wd);
+    g_object_unref (builder);
+    return box;
+}
+
+static void release_tab (int)
+{
+}
+
+static gboolean reboot_needed (void)
+{
+    return FALSE;
+}
+
+static void free_plugin (void)
+{
+    int tab;
+
+    for (tab = 0; tab < ntabs; tab++)
+    {
+        g_free (names[tab]);
+        g_free (ids[tab]);
+    }
+    g_free (names);
+    g_free (ids);
+    ntabs = 0;
+}
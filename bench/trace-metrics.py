@@ -0,0 +1,64 @@
+#!/usr/bin/env python3
+#
+# Reduce rpcc traces (see RPCC_TRACE in the README) to startup metrics in JSON.
+#
+# Usage: trace-metrics.py TABS PASS TRACE [TABS PASS TRACE ...]
+#
+# Prints a JSON array with one object per trace. Times are in milliseconds; any metric
+# which is missing from a trace is null.
+
+import json
+import statistics
+import sys
+
+
+def ms(us):
+    return None if us is None else round(us / 1000.0, 3)
+
+
+def metrics(tabs, label, path):
+    with open(path) as f:
+        events = json.load(f)['traceEvents']
+
+    def span(name):
+        durs = [e['dur'] for e in events if e['name'] == name and e['ph'] == 'X']
+        return durs[0] if durs else None
+
+    def mark(name):
+        ts = [e['ts'] for e in events if e['name'] == name and e['ph'] == 'i']
+        return ts[0] if ts else None
+
+    def counter(name):
+        vals = [e['args']['value'] for e in events if e['name'] == name and e['ph'] == 'C']
+        return vals[-1] if vals else None
+
+    switches = sorted(e['dur'] for e in events if e['name'] == 'tab_switch' and e['ph'] == 'X')
+    switch = {'count': len(switches), 'median_ms': None, 'p90_ms': None, 'max_ms': None}
+    if switches:
+        switch['median_ms'] = ms(statistics.median(switches))
+        switch['p90_ms'] = ms(switches[min(len(switches) - 1, int(len(switches) * 0.9))])
+        switch['max_ms'] = ms(switches[-1])
+
+    return {
+        'tabs': int(tabs),
+        'pass': label,
+        'first_frame_ms': ms(span('first_frame')),
+        'init_window_ms': ms(span('init_window')),
+        'plugins_loaded_ms': ms(mark('plugins_loaded')),
+        'peak_rss_kb': counter('peak_rss_kb'),
+        'tab_switch': switch,
+    }
+
+
+def main(args):
+    if not args or len(args) % 3:
+        sys.stderr.write('Usage: trace-metrics.py TABS PASS TRACE [TABS PASS TRACE ...]\n')
+        return 1
+    runs = [metrics(*args[i:i + 3]) for i in range(0, len(args), 3)]
+    json.dump(runs, sys.stdout, indent=2)
+    sys.stdout.write('\n')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
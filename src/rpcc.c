@@ -25,13 +25,27 @@ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 ============================================================================*/
 
+#define _GNU_SOURCE
 #include <locale.h>
+#include <signal.h>
+#include <errno.h>
 #include <dlfcn.h>
 #include <dirent.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <link.h>
+#include <elf.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
 #include <gtk/gtk.h>
+#include <glib-unix.h>
 #include <glib/gi18n.h>
 #include "rpcc.h"
+#include "builtin-plugins.h"
 
 /*----------------------------------------------------------------------------*/
 /* Typedefs and macros */
@@ -42,231 +56,2860 @@ typedef enum {
     WM_WAYFIRE,
     WM_LABWC } wm_type;
 
+typedef enum {
+    MEM_DLOPEN,
+    MEM_PREFETCH,
+    MEM_INIT,
+    MEM_GET_TAB,
+    MEM_FREE,
+    MEM_STAGES } mem_stage;
+
+typedef struct {
+    long heap;
+    long rss;
+} mem_sample_t;
+
+typedef struct {
+    char *path;
+    void *phandle;
+    const rpcc_plugin_t *(*builtin) (void);
+    rpcc_plugin_t desc;
+    GHashTable *funcs;
+    mem_sample_t mem[MEM_STAGES];
+    gint64 wakeups;
+    gint64 hidden_wakeups;
+    gboolean broken;
+} plugin_t;
+
+typedef struct {
+    plugin_t *plugin;
+    int tab;
+    char *name;
+    char *id;
+    char *key;
+    char *icon_name;
+    GtkWidget *page;
+    GtkWidget *label;
+    GtkWidget *icon;
+    gboolean built;
+    gint64 last_shown;
+} tab_t;
+
+typedef struct {
+    GSourceFunc func;
+    gpointer data;
+    plugin_t *plugin;
+} wakeup_t;
+
+#define HIBERNATE_SECS 300
+
+typedef struct {
+    int count;
+    int max_ms;
+    int total_ms;
+} stall_t;
+
+#define WATCHDOG_FRAMES 32
+
+typedef struct {
+    event_handler handler;
+    void *data;
+} subscriber_t;
+
+typedef struct {
+    char *name;
+    GVariant *payload;
+} event_t;
+
+typedef struct {
+    char *key;
+    char *name;
+    int scale;
+    gint64 start;
+} icon_req_t;
+
+typedef struct {
+    char *section;
+    char *key;
+    char *value;
+} conf_edit_t;
+
+typedef struct {
+    char *path;
+    GPtrArray *lines;
+    GPtrArray *edits;
+    guint queued;
+    GFileMonitor *monitor;
+} conf_file_t;
+
+#define CONF_FLUSH_MS 500
+
+typedef struct {
+    char **argv;
+    command_callback callback;
+    void *data;
+    GSubprocess *proc;
+} command_t;
+
+typedef struct {
+    char *output;
+    int status;
+    gint64 expires;
+    gboolean running;
+} cache_entry_t;
+
+typedef struct {
+    char *key;
+    apply_callback func;
+    void *data;
+    void (*free_data) (void *);
+    gint64 first;
+    guint timer;
+} apply_t;
+
+typedef struct {
+    char *path;
+    char *contents;
+    gsize len;
+    char *tmp;
+    char **argv;
+    char *reason;
+} priv_op_t;
+
+/* written by the privileged script as it goes, so that a failure can be traced to a stage */
+#define PRIV_COMMITTED "@rpcc-committed@"
+#define PRIV_RAN "@rpcc-ran@"
+
 /*----------------------------------------------------------------------------*/
 /* Global data */
 /*----------------------------------------------------------------------------*/
 
 static wm_type wm;
-static GList *plugin_handles = NULL;
+static GtkApplication *app;
+static gboolean started = FALSE;
+static gboolean ready = FALSE;
+static gboolean resident = FALSE;
+static GList *plugins = NULL;
+static GPtrArray *tabs = NULL;
+static GtkBuilder *builder;
 static GtkWidget *dlg, *msg_dlg, *nb;
-static gulong draw_id;
 static gboolean reboot = FALSE;
 static gboolean tab_set = FALSE;
 static gboolean wifi_ctry = FALSE;
 static char *st_tab;
-static int tabs_x;
+static const char *plugin_path;
 static GdkCursor *watch;
+static GHashTable *event_table = NULL;
+static GQueue event_queue = G_QUEUE_INIT;
+static guint event_idle_id = 0;
+static GHashTable *icon_cache;
+static GCancellable *icon_cancel;
+static int icon_size, icon_scale;
+static char *icon_theme;
+static tab_t *visible_tab = NULL;
+static int hibernate_secs = HIBERNATE_SECS;
+static guint hibernate_id = 0;
+static long hibernate_kb = 0;
+static gboolean mem_report = FALSE;
+static GThread *watchdog = NULL;
+static int watchdog_ms;
+static gint watchdog_time = 0;
+static gint watchdog_stop = 0;
+static gint64 watchdog_origin;
+static pid_t main_tid;
+static void *stall_frames[WATCHDOG_FRAMES];
+static volatile sig_atomic_t stall_depth;
+static GHashTable *stall_summary;
+static gboolean bind_now = FALSE;
+static GQueue load_queue = G_QUEUE_INIT;
+static GThreadPool *load_pool = NULL;
+static int load_pending = 0;
+static guint load_id = 0;
+static GKeyFile *manifest = NULL;
+static gboolean manifest_changed = FALSE;
+static int saved_tab = -1;
+static gboolean page_switched = FALSE;
+static GHashTable *conf_files = NULL;
+static GMutex conf_lock;
+static guint conf_flush_id = 0;
+static GQueue cmd_queue = G_QUEUE_INIT;
+static GList *cmd_active = NULL;
+static int cmd_running = 0;
+static GCancellable *cmd_cancel;
+static GHashTable *cache_table = NULL;
+static GMutex cache_lock;
+static GCond cache_cond;
+static guint cache_gen = 0;
+static gint cache_hits = 0;
+static gint cache_misses = 0;
+static GHashTable *apply_pending = NULL;
+static GList *priv_ops = NULL;
+static GMutex priv_lock;
+static gboolean priv_flush = FALSE;
+static GPtrArray *priv_reasons = NULL;
+static GString *trace_buf = NULL;
+static GMutex trace_lock;
+static gint64 trace_origin;
+static char *trace_path;
+static gint64 switch_start;
+static char *switch_name;
+static gint64 run_start;
+
+/* Plugins linked into the binary, generated by the build from the static_plugins option */
+
+#define BUILTIN_PREFIX "builtin:"
+
+BUILTIN_PLUGIN_DECLS
+
+static const struct {
+    const char *name;
+    const char *file;
+    const rpcc_plugin_t *(*descriptor) (void);
+} builtin_plugins[] = { BUILTIN_PLUGIN_TABLE { NULL, NULL, NULL } };
 
 /*----------------------------------------------------------------------------*/
 /* Function prototypes */
 /*----------------------------------------------------------------------------*/
 
-static int (*plugin_tabs) (void);
-static void (*init_plugin) (GtkWidget *parent);
-static const char *(*tab_name) (int tab);
-static const char *(*tab_id) (int tab);
-static GtkWidget *(*get_tab) (int tab);
-static gboolean (*reboot_needed) (void);
-static void (*free_plugin) (void);
-static const char *(*icon_name) (int tab);
-
-static void load_plugin (GtkWidget *nb, const char *filename);
-static void free_plugins (void *phandle, gpointer);
-static void call_func (void *phandle, gpointer data);
+static void trace_init (void);
+static void trace_string (const char *str);
+static void trace_add (char type, const char *name, const char *detail, gint64 start, gint64 end);
+static gint64 trace_begin (void);
+static void trace_end (const char *name, const char *detail, gint64 start);
+static void trace_mark (const char *name, const char *detail);
+static void trace_counter (const char *name, gint64 value);
+static gboolean trace_frame (GtkWidget *, cairo_t *, gpointer);
+static void trace_write (void);
+static gboolean verify_interface (plugin_t *plugin);
+static gboolean open_plugin (plugin_t *plugin);
+static void start_plugin (plugin_t *plugin);
+static gboolean load_plugin (plugin_t *plugin);
+static void build_tab (GtkWidget *page);
+static gboolean drop_plugin (gpointer data);
+static void switch_page (GtkNotebook *, GtkWidget *page, guint, gpointer);
+static void add_tab (plugin_t *plugin, int tab, const char *name, const char *id, const char *icon_str);
+static guint tab_position (const char *key);
+static gboolean select_tab (const char *id);
+static void find_start_tab (void);
+static void free_tab (gpointer data);
+static gboolean is_builtin (const char *name, const char *suffix);
+static plugin_t *scan_plugin (char *path, const rpcc_plugin_t *(*builtin) (void), GKeyFile *kf, gboolean *changed);
+static void queue_plugin (plugin_t *plugin);
+static void add_plugin_tabs (plugin_t *plugin, GKeyFile *kf);
+static gboolean manifest_has_tab (GKeyFile *kf, const char *path, const char *id);
+static void plugin_ready (plugin_t *plugin);
+static gboolean prefetch_done (gpointer data);
+static void prefetch_thread (gpointer data, gpointer);
+static gboolean prefetch_threaded (plugin_t *plugin);
+static gboolean load_next (gpointer);
+static void scan_plugins (void);
+static void finish_loading (void);
+static void stop_loading (void);
+static void close_plugin (gpointer data, gpointer);
+static void free_plugins (gpointer data, gpointer);
+static void call_func (gpointer data, gpointer name);
+static GArray *event_subs (const char *event);
+static GVariant *event_deliver (const char *event, GVariant *payload);
+static void event_free (event_t *ev);
+static gboolean event_idle (gpointer);
+static void load_icon (tab_t *tdata);
+static void icon_loaded (GObject *source, GAsyncResult *res, gpointer data);
 static void update_icons (GtkWidget *, gpointer);
-static void reboot_check (void *phandle, gpointer);
+static void update_visible_tab (GtkWidget *page);
+static gboolean window_state (GtkWidget *, GdkEvent *, gpointer);
+static void window_active (GObject *, GParamSpec *, gpointer);
+static gboolean wakeup_dispatch (gpointer data);
+static long rss_kb (void);
+static void mark_tab_shown (GtkWidget *page);
+static void hibernate_tab (tab_t *tdata);
+static gboolean hibernate_check (gpointer);
+static long heap_kb (void);
+static void mem_begin (mem_sample_t *mem);
+static void mem_end (plugin_t *plugin, mem_stage stage, mem_sample_t *mem);
+static void mem_write (void);
+static gboolean mem_signal (gpointer);
+static void watchdog_signal (int);
+static gboolean watchdog_beat (gpointer);
+static char *watchdog_where (void);
+static void watchdog_record (const char *where, int start, int end);
+static gpointer watchdog_thread (gpointer);
+static void watchdog_start (void);
+static void watchdog_end (void);
+static int readahead_loaded (struct dl_phdr_info *info, size_t, void *data);
+static void readahead_needed (const char *map, size_t len, GHashTable *seen, GQueue *todo, const char *libdir);
+static gpointer readahead_thread (gpointer);
+static char *conf_trim (const char *str, int len);
+static gboolean conf_in_section (const char *cur, const char *section);
+static gboolean conf_match (const char *name, const char *value, const char *key);
+static int conf_find (GPtrArray *lines, const char *section, const char *key, int *end);
+static void conf_apply (GPtrArray *lines, conf_edit_t *edit);
+static GPtrArray *conf_read (const char *path);
+static void conf_changed (GFileMonitor *, GFile *, GFile *, GFileMonitorEvent event, gpointer data);
+static conf_file_t *conf_lookup (const char *path);
+static void conf_free_edit (gpointer data);
+static gboolean conf_writable (const char *path);
+static gboolean conf_write (const char *path, const char *contents, gsize len);
+static void conf_flush_file (gpointer, gpointer value, gpointer);
+static void conf_applied (gpointer, gpointer value, gpointer);
+static void conf_discard (gpointer, gpointer value, gpointer);
+static gboolean conf_flush_timeout (gpointer);
+static void cmd_busy (gboolean busy);
+static void cmd_free (command_t *cmd);
+static void cmd_start (void);
+static void cmd_done (GObject *, GAsyncResult *res, gpointer data);
+static int cmd_output (const char * const *argv, char **output);
+static void cmd_run_sync (const char * const *argv, command_callback callback, void *data);
+static void cmd_finish_all (void);
+static void cache_free (gpointer data);
+static void cache_count (gint *counter, const char *name);
+static void apply_free (apply_t *apply);
+static void apply_run (apply_t *apply);
+static gboolean apply_timeout (gpointer data);
+static void priv_free (priv_op_t *op);
+static void priv_add (priv_op_t *op);
+static void priv_queue (priv_op_t *op);
+static void priv_append (GString *script, const char * const *argv);
+static gboolean priv_write_tmp (priv_op_t *op);
+static void reboot_check (gpointer data, gpointer);
 static void close_with_prompt (void);
 static gboolean close_app (GtkButton *button, gpointer);
+static gboolean close_msg (GtkButton *button, gpointer);
+static gboolean close_discard (GtkButton *button, gpointer);
 static gboolean close_app_reboot (GtkButton *button, gpointer);
-static void message (char *msg);
 static gboolean ok_main (GtkButton *button, gpointer data);
 static gboolean close_prog (GtkWidget *widget, GdkEvent *event, gpointer data);
 static gboolean scroll (GtkWidget *, GdkEventScroll *ev, gpointer);
 static void load_config (int *w, int *h, int *tab);
 static void save_config (void);
-static gboolean init_window (gpointer);
-static gboolean draw (GtkWidget *wid, cairo_t *cr, gpointer data);
+static void init_window (void);
+static void show_window (void);
+static gboolean terminate (gpointer);
+static void app_startup (GApplication *, gpointer);
+static int app_command_line (GApplication *, GApplicationCommandLine *cmdline, gpointer);
+static gboolean headless_arg (const char *arg);
+static void headless_open (char *path, const rpcc_plugin_t *(*builtin) (void));
+static void headless_load (void);
+static plugin_t *find_setting (const char *id);
+static void print_setting (plugin_t *plugin, const char *id, gboolean with_id);
+static int headless_main (int argc, char *argv[]);
+
+/*----------------------------------------------------------------------------*/
+/* Tracing */
+/*----------------------------------------------------------------------------*/
+
+/* If RPCC_TRACE is set to a file path, the timings of startup and of significant events
+ * are written to it in Chrome trace event format when the application exits, for viewing
+ * in Perfetto or chrome://tracing. Events may be recorded from any thread. */
+
+static void trace_init (void)
+{
+    const char *path = getenv ("RPCC_TRACE");
+
+    if (!path || !*path) return;
+    trace_path = g_strdup (path);
+    trace_buf = g_string_new ("{\"traceEvents\":[\n");
+    trace_origin = g_get_monotonic_time ();
+}
+
+static void trace_string (const char *str)
+{
+    for (; *str; str++)
+    {
+        if (*str == '"' || *str == '\\') g_string_append_c (trace_buf, '\\');
+        if ((unsigned char) *str < 0x20) g_string_append_printf (trace_buf, "\\u%04x", *str);
+        else g_string_append_c (trace_buf, *str);
+    }
+}
+
+static void trace_add (char type, const char *name, const char *detail, gint64 start, gint64 end)
+{
+    g_mutex_lock (&trace_lock);
+
+    /* threads such as readahead may still be running when the trace is written out */
+    if (!trace_buf)
+    {
+        g_mutex_unlock (&trace_lock);
+        return;
+    }
+    g_string_append (trace_buf, "{\"name\":\"");
+    trace_string (name);
+    g_string_append_printf (trace_buf, "\",\"cat\":\"rpcc\",\"ph\":\"%c\",\"ts\":%" G_GINT64_FORMAT ",\"pid\":%d,\"tid\":%ld",
+        type, start - trace_origin, getpid (), (long) syscall (SYS_gettid));
+    if (type == 'X') g_string_append_printf (trace_buf, ",\"dur\":%" G_GINT64_FORMAT, end - start);
+    else g_string_append (trace_buf, ",\"s\":\"t\"");
+    if (detail)
+    {
+        g_string_append (trace_buf, ",\"args\":{\"detail\":\"");
+        trace_string (detail);
+        g_string_append (trace_buf, "\"}");
+    }
+    g_string_append (trace_buf, "},\n");
+    g_mutex_unlock (&trace_lock);
+}
+
+static gint64 trace_begin (void)
+{
+    return trace_buf ? g_get_monotonic_time () : 0;
+}
+
+static void trace_end (const char *name, const char *detail, gint64 start)
+{
+    if (trace_buf) trace_add ('X', name, detail, start, g_get_monotonic_time ());
+}
+
+static void trace_mark (const char *name, const char *detail)
+{
+    if (trace_buf) trace_add ('i', name, detail, g_get_monotonic_time (), 0);
+}
+
+static void trace_counter (const char *name, gint64 value)
+{
+    if (!trace_buf) return;
+
+    g_mutex_lock (&trace_lock);
+    if (!trace_buf)
+    {
+        g_mutex_unlock (&trace_lock);
+        return;
+    }
+    g_string_append (trace_buf, "{\"name\":\"");
+    trace_string (name);
+    g_string_append_printf (trace_buf, "\",\"cat\":\"rpcc\",\"ph\":\"C\",\"ts\":%" G_GINT64_FORMAT ",\"pid\":%d,\"args\":{\"value\":%" G_GINT64_FORMAT "}},\n",
+        g_get_monotonic_time () - trace_origin, getpid (), value);
+    g_mutex_unlock (&trace_lock);
+}
+
+/* Connected after the main window's own draw handler, to time the first frame and the
+ * latency from a tab switch to the frame which shows the new tab. */
+
+static gboolean trace_frame (GtkWidget *, cairo_t *, gpointer)
+{
+    static gboolean first = TRUE;
+
+    if (first)
+    {
+        trace_end ("first_frame", NULL, trace_origin);
+        first = FALSE;
+    }
+    if (switch_name)
+    {
+        trace_end ("tab_switch", switch_name, switch_start);
+        g_free (switch_name);
+        switch_name = NULL;
+    }
+    return FALSE;
+}
+
+static void trace_write (void)
+{
+    struct rusage usage;
+
+    if (!trace_buf) return;
+
+    getrusage (RUSAGE_SELF, &usage);
+    trace_counter ("peak_rss_kb", usage.ru_maxrss);
+
+    g_mutex_lock (&trace_lock);
+    if (g_str_has_suffix (trace_buf->str, ",\n")) g_string_truncate (trace_buf, trace_buf->len - 2);
+    g_string_append (trace_buf, "\n]}\n");
+    if (!g_file_set_contents (trace_path, trace_buf->str, trace_buf->len, NULL))
+        fprintf (stderr, "Unable to write trace to %s\n", trace_path);
+
+    g_string_free (trace_buf, TRUE);
+    trace_buf = NULL;
+    g_mutex_unlock (&trace_lock);
+    g_free (trace_path);
+}
 
 /*----------------------------------------------------------------------------*/
 /* Plugin management */
 /*----------------------------------------------------------------------------*/
 
-static gboolean verify_interface (void *phandle)
+/* A version 2 plugin returns its descriptor from a single symbol; for the original
+ * interface, the descriptor is filled in by looking up each function once */
+
+#define DESC_FUNC(field) { #field, G_STRUCT_OFFSET (rpcc_plugin_t, field) }
+#define DESC_MIN_SIZE (G_STRUCT_OFFSET (rpcc_plugin_t, free_plugin) + sizeof (void *))
+
+static gboolean verify_interface (plugin_t *plugin)
 {
-    static const char * const symbols[] = {
-        "init_plugin",
-        "plugin_tabs",
-        "tab_name",
-        "tab_id",
-        "get_tab",
-        "icon_name",
-        "reboot_needed",
-        "free_plugin",
-        NULL,
+    static const struct {
+        const char *name;
+        glong offset;
+    } funcs[] = {
+        DESC_FUNC (init_plugin),
+        DESC_FUNC (plugin_tabs),
+        DESC_FUNC (tab_name),
+        DESC_FUNC (tab_id),
+        DESC_FUNC (get_tab),
+        DESC_FUNC (icon_name),
+        DESC_FUNC (reboot_needed),
+        DESC_FUNC (free_plugin),
     };
-    for (size_t i = 0; symbols[i]; i++) {
-        if (!dlsym (phandle, symbols[i])) {
-            fprintf (stderr, "Missing symbol '%s'\n", symbols[i]);
+    const rpcc_plugin_t *(*descriptor) (void);
+    const rpcc_plugin_t *desc;
+    gboolean (*lazy_tabs) (void);
+    size_t i;
+
+    memset (&plugin->desc, 0, sizeof (rpcc_plugin_t));
+    descriptor = plugin->builtin ? plugin->builtin : dlsym (plugin->phandle, "plugin_descriptor");
+    if (descriptor)
+    {
+        desc = descriptor ();
+        if (!desc || desc->abi_version != RPCC_ABI_VERSION || desc->size < DESC_MIN_SIZE)
+        {
+            fprintf (stderr, "Unsupported plugin descriptor\n");
+            return FALSE;
+        }
+
+        /* fields added after the plugin was built are left as NULL */
+        memcpy (&plugin->desc, desc, MIN (desc->size, sizeof (rpcc_plugin_t)));
+    }
+    else
+    {
+        for (i = 0; i < G_N_ELEMENTS (funcs); i++)
+            G_STRUCT_MEMBER (void *, &plugin->desc, funcs[i].offset) = dlsym (plugin->phandle, funcs[i].name);
+
+        /* optional - data gathering which does not need GTK, run on a worker thread */
+        plugin->desc.prefetch_plugin = dlsym (plugin->phandle, "prefetch_plugin");
+        plugin->desc.flags |= RPCC_PLUGIN_THREADED_PREFETCH;
+
+        /* optional - tabs whose widgets can be destroyed and rebuilt while loaded */
+        plugin->desc.release_tab = dlsym (plugin->phandle, "release_tab");
+        if (plugin->desc.release_tab) plugin->desc.flags |= RPCC_PLUGIN_RELEASE_TAB;
+
+        /* optional - settings which can be read and changed without GTK */
+        plugin->desc.plugin_settings = dlsym (plugin->phandle, "plugin_settings");
+        plugin->desc.get_setting = dlsym (plugin->phandle, "get_setting");
+        plugin->desc.set_setting = dlsym (plugin->phandle, "set_setting");
+
+        /* optional - told when tabs and the window can and cannot be seen */
+        plugin->desc.tab_visible = dlsym (plugin->phandle, "tab_visible");
+        plugin->desc.window_active = dlsym (plugin->phandle, "window_active");
+    }
+
+    for (i = 0; i < G_N_ELEMENTS (funcs); i++)
+    {
+        if (!G_STRUCT_MEMBER (void *, &plugin->desc, funcs[i].offset))
+        {
+            fprintf (stderr, "Missing symbol '%s'\n", funcs[i].name);
             return FALSE;
         }
     }
+
+    /* optional - plugins which cannot build their tabs on demand return FALSE */
+    if (!descriptor)
+    {
+        lazy_tabs = dlsym (plugin->phandle, "lazy_tabs");
+        if (!lazy_tabs || lazy_tabs ()) plugin->desc.flags |= RPCC_PLUGIN_LAZY_TABS;
+    }
+
     return TRUE;
 }
 
-static void load_plugin (GtkWidget *, const char *filename)
+static gboolean open_plugin (plugin_t *plugin)
 {
-    GtkWidget *label, *page, *icon, *box;
-    void *phandle;
-    char *path;
-    int count, tab, font_height;
-    const char *name, *tablabel;
-    GdkPixbuf *pixbuf;
-    PangoFontDescription *font_desc;
-    GtkStyleContext *sc;
-    int scale;
+    mem_sample_t mem;
+    gboolean valid;
+    gint64 start;
+
+    mem_begin (&mem);
+    start = trace_begin ();
+    /* built-in plugins hold a handle to the program itself, so are opened and closed like any other */
+    if (plugin->builtin) plugin->phandle = dlopen (NULL, RTLD_LAZY);
+    else plugin->phandle = dlopen (plugin->path, bind_now ? RTLD_NOW : RTLD_LAZY);
+    trace_end ("dlopen", plugin->path, start);
+    if (!plugin->phandle) {
+        return FALSE;
+    }
+    start = trace_begin ();
+    valid = verify_interface (plugin);
+    trace_end ("verify_interface", plugin->path, start);
+    mem_end (plugin, MEM_DLOPEN, &mem);
+    if (!valid) {
+        dlclose (plugin->phandle);
+        plugin->phandle = NULL;
+        fprintf (stderr, "%s does not conform to the API interface\n", plugin->path);
+        return FALSE;
+    }
 
-    if (!strstr (filename, ".so")) return;
-    path = g_build_filename (PLUGIN_PATH, filename, NULL);
-    phandle = dlopen (path, RTLD_LAZY);
-    g_free (path);
-    if (!phandle) {
+    return TRUE;
+}
+
+static void run_prefetch (plugin_t *plugin)
+{
+    mem_sample_t mem;
+    gint64 start;
+
+    mem_begin (&mem);
+    start = trace_begin ();
+    plugin->desc.prefetch_plugin ();
+    trace_end ("prefetch_plugin", plugin->path, start);
+    mem_end (plugin, MEM_PREFETCH, &mem);
+}
+
+static void start_plugin (plugin_t *plugin)
+{
+    mem_sample_t mem;
+    gint64 start;
+
+    mem_begin (&mem);
+    start = trace_begin ();
+    plugin->desc.init_plugin (dlg);
+    trace_end ("init_plugin", plugin->path, start);
+    mem_end (plugin, MEM_INIT, &mem);
+}
+
+static gboolean load_plugin (plugin_t *plugin)
+{
+    if (plugin->phandle) return TRUE;
+    if (!open_plugin (plugin)) return FALSE;
+    if (plugin->desc.prefetch_plugin) run_prefetch (plugin);
+    start_plugin (plugin);
+    return TRUE;
+}
+
+static void build_tab (GtkWidget *page)
+{
+    tab_t *tdata = g_object_get_data (G_OBJECT (page), "tab");
+    mem_sample_t mem;
+    gint64 start;
+
+    if (!tdata || tdata->built || tdata->plugin->broken) return;
+    if (!load_plugin (tdata->plugin))
+    {
+        /* this is called while the notebook is switching pages, so the tabs are removed later */
+        tdata->plugin->broken = TRUE;
+        g_idle_add (drop_plugin, tdata->plugin);
         return;
     }
-    if (!verify_interface (phandle)) {
-        dlclose (phandle);
-        fprintf (stderr, "%s does not conform to the API interface\n", filename);
-        return;
+    mem_begin (&mem);
+    start = trace_begin ();
+    gtk_box_pack_start (GTK_BOX (page), tdata->plugin->desc.get_tab (tdata->tab), TRUE, TRUE, 0);
+    trace_end ("get_tab", tdata->name, start);
+    mem_end (tdata->plugin, MEM_GET_TAB, &mem);
+    tdata->built = TRUE;
+    tdata->last_shown = g_get_monotonic_time ();
+}
+
+/* A cached plugin which can no longer be loaded has its tabs removed, and its manifest
+ * entry dropped so that it is scanned again next time */
+
+static gboolean drop_plugin (gpointer data)
+{
+    plugin_t *plugin = (plugin_t *) data;
+    GKeyFile *kf;
+    tab_t *tdata;
+    char *cachefile, *str;
+    gsize len;
+    guint count;
+
+    if (!ready) return FALSE;
+
+    for (count = tabs->len; count > 0; count--)
+    {
+        tdata = g_ptr_array_index (tabs, count - 1);
+        if (tdata->plugin != plugin) continue;
+        gtk_notebook_remove_page (GTK_NOTEBOOK (nb), gtk_notebook_page_num (GTK_NOTEBOOK (nb), tdata->page));
+        g_ptr_array_remove_index (tabs, count - 1);
+    }
+
+    if (manifest)
+    {
+        g_key_file_remove_group (manifest, plugin->path, NULL);
+        manifest_changed = TRUE;
+    }
+    else
+    {
+        cachefile = g_build_filename (g_get_user_cache_dir (), "rpcc", "plugins.ini", NULL);
+        kf = g_key_file_new ();
+        if (g_key_file_load_from_file (kf, cachefile, G_KEY_FILE_NONE, NULL)
+            && g_key_file_remove_group (kf, plugin->path, NULL))
+        {
+            str = g_key_file_to_data (kf, &len, NULL);
+            g_file_set_contents (cachefile, str, len, NULL);
+            g_free (str);
+        }
+        g_key_file_free (kf);
+        g_free (cachefile);
     }
 
-    init_plugin = dlsym (phandle, "init_plugin");
-    plugin_tabs = dlsym (phandle, "plugin_tabs");
-    tab_name = dlsym (phandle, "tab_name");
-    tab_id = dlsym (phandle, "tab_id");
-    get_tab = dlsym (phandle, "get_tab");
-    icon_name = dlsym (phandle, "icon_name");
+    plugins = g_list_remove (plugins, plugin);
+    free_plugins (plugin, NULL);
+    return FALSE;
+}
 
-    init_plugin (dlg);
+static void switch_page (GtkNotebook *, GtkWidget *page, guint, gpointer)
+{
+    /* once the window is up, any change of page other than to the first tab added stops the saved tab being restored */
+    if (ready && gtk_notebook_get_current_page (GTK_NOTEBOOK (nb)) >= 0) page_switched = TRUE;
 
-    sc = gtk_widget_get_style_context (nb);
-    gtk_style_context_get (sc, gtk_style_context_get_state (sc), GTK_STYLE_PROPERTY_FONT, &font_desc, NULL);
-    font_height = pango_font_description_get_size (font_desc) / PANGO_SCALE;
-    pango_font_description_free (font_desc);
-    scale = gtk_widget_get_scale_factor (dlg);
+    /* the page being switched from is still the current page at this point */
+    mark_tab_shown (gtk_notebook_get_nth_page (GTK_NOTEBOOK (nb), gtk_notebook_get_current_page (GTK_NOTEBOOK (nb))));
+    mark_tab_shown (page);
+
+    trace_mark ("switch_page", gtk_notebook_get_menu_label_text (GTK_NOTEBOOK (nb), page));
+    if (trace_buf && gtk_widget_get_mapped (dlg))
+    {
+        g_free (switch_name);
+        switch_name = g_strdup (gtk_notebook_get_menu_label_text (GTK_NOTEBOOK (nb), page));
+        switch_start = g_get_monotonic_time ();
+    }
+    build_tab (page);
+    update_visible_tab (page);
+}
+
+static void add_tab (plugin_t *plugin, int tab, const char *name, const char *id, const char *icon_str)
+{
+    GtkWidget *label, *page, *icon, *box;
+    tab_t *tdata;
+    guint pos;
+
+    label = gtk_label_new (name);
+    icon = gtk_image_new ();
+
+    box = gtk_box_new (GTK_ORIENTATION_HORIZONTAL, 5);
+    gtk_box_pack_start (GTK_BOX (box), icon, FALSE, FALSE, 0);
+    gtk_box_pack_start (GTK_BOX (box), label, FALSE, FALSE, 0);
+    gtk_widget_show_all (box);
+
+    /* the page is an empty box until the tab is first shown, when get_tab is called to fill it */
+    page = gtk_box_new (GTK_ORIENTATION_VERTICAL, 0);
+    gtk_widget_show (page);
+
+    tdata = g_new0 (tab_t, 1);
+    tdata->plugin = plugin;
+    tdata->tab = tab;
+    tdata->name = g_strdup (name);
+    tdata->id = g_strdup (id);
+    tdata->key = g_utf8_collate_key (name ? name : "", -1);
+    tdata->icon_name = g_strdup (icon_str);
+    tdata->page = page;
+    tdata->label = box;
+    tdata->icon = icon;
+    g_object_set_data (G_OBJECT (page), "tab", tdata);
+    load_icon (tdata);
+
+    /* the registry and the notebook are both kept in order of name */
+    pos = tab_position (tdata->key);
+    g_ptr_array_insert (tabs, pos, tdata);
+    gtk_notebook_insert_page (GTK_NOTEBOOK (nb), page, box, pos);
+    gtk_notebook_set_menu_label_text (GTK_NOTEBOOK (nb), page, tdata->name);
+
+    if (plugin->phandle && !(plugin->desc.flags & RPCC_PLUGIN_LAZY_TABS)) build_tab (page);
+}
+
+static guint tab_position (const char *key)
+{
+    guint lo = 0, hi = tabs->len, mid;
+    tab_t *tdata;
+
+    while (lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        tdata = g_ptr_array_index (tabs, mid);
+        if (strcmp (tdata->key, key) <= 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static gboolean select_tab (const char *id)
+{
+    tab_t *tdata;
+    guint count;
+
+    if (!id) return FALSE;
+    for (count = 0; count < tabs->len; count++)
+    {
+        tdata = g_ptr_array_index (tabs, count);
+        if (!g_strcmp0 (id, tdata->id))
+        {
+            gtk_notebook_set_current_page (GTK_NOTEBOOK (nb), gtk_notebook_page_num (GTK_NOTEBOOK (nb), tdata->page));
+            return TRUE;
+        }
+        else if (!g_strcmp0 (id, "wifi_country") && !g_strcmp0 (tdata->id, "localisation"))
+        {
+            gtk_notebook_set_current_page (GTK_NOTEBOOK (nb), gtk_notebook_page_num (GTK_NOTEBOOK (nb), tdata->page));
+            wifi_ctry = TRUE;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* Selects the tab asked for on the command line as soon as it has been added */
+
+static void find_start_tab (void)
+{
+    if (tab_set || !select_tab (st_tab)) return;
+    tab_set = TRUE;
+    if (wifi_ctry && ready) call_plugin_func ("on_set_wifi");
+}
+
+static void free_tab (gpointer data)
+{
+    tab_t *tdata = (tab_t *) data;
+
+    g_free (tdata->name);
+    g_free (tdata->id);
+    g_free (tdata->key);
+    g_free (tdata->icon_name);
+    g_free (tdata);
+}
+
+static void close_plugin (gpointer data, gpointer)
+{
+    plugin_t *plugin = (plugin_t *) data;
+    mem_sample_t mem;
+    gint64 start;
+
+    if (!plugin->phandle) return;
+
+    mem_begin (&mem);
+    start = trace_begin ();
+    plugin->desc.free_plugin ();
+    trace_end ("free_plugin", plugin->path, start);
+    dlclose (plugin->phandle);
+    plugin->phandle = NULL;
+    mem_end (plugin, MEM_FREE, &mem);
+}
+
+static void free_plugins (gpointer data, gpointer)
+{
+    plugin_t *plugin = (plugin_t *) data;
+
+    if (plugin->funcs) g_hash_table_destroy (plugin->funcs);
+    g_free (plugin->path);
+    g_free (plugin);
+}
+
+static void call_func (gpointer data, gpointer name)
+{
+    plugin_t *plugin = (plugin_t *) data;
+    void (*func) (void);
+    char *sym;
+
+    if (!plugin->phandle) return;
+
+    /* each function is looked up once, and a missing one is remembered as NULL */
+    if (!plugin->funcs) plugin->funcs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    if (!g_hash_table_lookup_extended (plugin->funcs, name, NULL, (gpointer *) &func))
+    {
+        /* functions of built-in plugins are prefixed with the plugin name, as they share one namespace */
+        if (plugin->builtin)
+        {
+            sym = g_strdup_printf ("%s_%s", plugin->path + strlen (BUILTIN_PREFIX), (char *) name);
+            func = dlsym (plugin->phandle, sym);
+            g_free (sym);
+        }
+        else func = dlsym (plugin->phandle, (char *) name);
+        g_hash_table_insert (plugin->funcs, g_strdup (name), func);
+    }
+    if (func) func ();
+}
+
+/* Calls the named function in each loaded plugin which exports it, and also delivers
+ * the event of the same name, without a payload, to its subscribers */
+
+void call_plugin_func (char *name)
+{
+    GVariant *reply;
+    gint64 start = trace_begin ();
+
+    reply = emit_event (name, NULL);
+    if (reply) g_variant_unref (reply);
+    g_list_foreach (plugins, call_func, name);
+    trace_end ("call_plugin_func", name, start);
+}
+
+const char *dgetfixt (const char *domain, const char *msgctxid)
+{
+    const char *text = dgettext (domain, msgctxid);
+    if (g_strcmp0 (msgctxid, text)) return text;
+    return strchr (msgctxid, 0x04) + 1;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Plugin events */
+/*----------------------------------------------------------------------------*/
+
+/* Plugins subscribe to named events, usually in init_plugin, and other plugins emit them
+ * with an optional GVariant payload. Handlers are called in the order in which they
+ * subscribed. The handler list for an event is replaced rather than changed when
+ * subscriptions change, so handlers can subscribe and unsubscribe during delivery. */
+
+static GArray *event_subs (const char *event)
+{
+    if (!event_table) return NULL;
+    return g_hash_table_lookup (event_table, event);
+}
+
+static GVariant *event_deliver (const char *event, GVariant *payload)
+{
+    GArray *subs;
+    GVariant *reply = NULL, *res;
+    subscriber_t *sub;
+    gint64 start;
+    guint i;
+
+    subs = event_subs (event);
+    if (!subs) return NULL;
+
+    start = trace_begin ();
+    g_array_ref (subs);
+    for (i = 0; i < subs->len; i++)
+    {
+        sub = &g_array_index (subs, subscriber_t, i);
+        res = sub->handler (event, payload, sub->data);
+        if (!res) continue;
+
+        /* the first reply is returned to the caller; any others are discarded */
+        g_variant_ref_sink (res);
+        if (reply) g_variant_unref (res);
+        else reply = res;
+    }
+    g_array_unref (subs);
+    trace_end ("event", event, start);
+
+    return reply;
+}
+
+static void event_free (event_t *ev)
+{
+    if (ev->payload) g_variant_unref (ev->payload);
+    g_free (ev->name);
+    g_free (ev);
+}
+
+static gboolean event_idle (gpointer)
+{
+    event_t *ev;
+    GVariant *reply;
+
+    event_idle_id = 0;
+    while ((ev = g_queue_pop_head (&event_queue)))
+    {
+        reply = event_deliver (ev->name, ev->payload);
+        if (reply) g_variant_unref (reply);
+        event_free (ev);
+    }
+    return FALSE;
+}
+
+void subscribe_event (const char *event, event_handler handler, void *data)
+{
+    GArray *subs, *old;
+    subscriber_t sub;
+
+    if (!event_table) event_table = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_array_unref);
+
+    subs = g_array_new (FALSE, FALSE, sizeof (subscriber_t));
+    old = event_subs (event);
+    if (old) g_array_append_vals (subs, old->data, old->len);
+    sub.handler = handler;
+    sub.data = data;
+    g_array_append_val (subs, sub);
+    g_hash_table_insert (event_table, g_strdup (event), subs);
+}
+
+void unsubscribe_event (const char *event, event_handler handler, void *data)
+{
+    GArray *subs, *old;
+    subscriber_t *sub;
+    guint i;
+
+    old = event_subs (event);
+    if (!old) return;
+
+    subs = g_array_new (FALSE, FALSE, sizeof (subscriber_t));
+    for (i = 0; i < old->len; i++)
+    {
+        sub = &g_array_index (old, subscriber_t, i);
+        if (sub->handler != handler || sub->data != data) g_array_append_vals (subs, sub, 1);
+    }
+
+    if (subs->len) g_hash_table_insert (event_table, g_strdup (event), subs);
+    else
+    {
+        g_array_unref (subs);
+        g_hash_table_remove (event_table, event);
+    }
+}
+
+GVariant *emit_event (const char *event, GVariant *payload)
+{
+    GVariant *reply;
 
-    for (tab = 0; tab < plugin_tabs (); tab++)
+    if (payload) g_variant_ref_sink (payload);
+    reply = event_deliver (event, payload);
+    if (payload) g_variant_unref (payload);
+    return reply;
+}
+
+void post_event (const char *event, GVariant *payload)
+{
+    event_t *ev;
+
+    ev = g_new0 (event_t, 1);
+    ev->name = g_strdup (event);
+    if (payload) ev->payload = g_variant_ref_sink (payload);
+    g_queue_push_tail (&event_queue, ev);
+
+    if (!event_idle_id) event_idle_id = g_idle_add (event_idle, NULL);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Tab icons */
+/*----------------------------------------------------------------------------*/
+
+/* Tab icons are loaded asynchronously, and cached as surfaces keyed on icon name, size,
+ * scale and theme. They are only reloaded when the size, scale or theme changes. */
+
+static void load_icon (tab_t *tdata)
+{
+    GtkIconInfo *info;
+    cairo_surface_t *surface;
+    icon_req_t *req;
+    char *key;
+
+    if (!tdata->icon_name) return;
+    gtk_widget_set_size_request (tdata->icon, icon_size, icon_size);
+
+    key = g_strdup_printf ("%s:%d:%d:%s", tdata->icon_name, icon_size, icon_scale, icon_theme);
+    if (g_hash_table_lookup_extended (icon_cache, key, NULL, (gpointer *) &surface))
+    {
+        /* a NULL surface means the icon is still loading - it is set on all tabs which use it when done */
+        if (surface) gtk_image_set_from_surface (GTK_IMAGE (tdata->icon), surface);
+        g_free (key);
+        return;
+    }
+
+    info = gtk_icon_theme_lookup_icon_for_scale (gtk_icon_theme_get_default (), tdata->icon_name, icon_size, icon_scale, GTK_ICON_LOOKUP_FORCE_SIZE);
+    if (!info)
+    {
+        g_free (key);
+        return;
+    }
+
+    req = g_new0 (icon_req_t, 1);
+    req->key = g_strdup (key);
+    req->name = g_strdup (tdata->icon_name);
+    req->scale = icon_scale;
+    req->start = trace_begin ();
+    g_hash_table_insert (icon_cache, key, NULL);
+    gtk_icon_info_load_icon_async (info, icon_cancel, icon_loaded, req);
+    g_object_unref (info);
+}
+
+static void icon_loaded (GObject *source, GAsyncResult *res, gpointer data)
+{
+    icon_req_t *req = (icon_req_t *) data;
+    cairo_surface_t *surface;
+    GdkPixbuf *pixbuf;
+    GError *err = NULL;
+    tab_t *tdata;
+    guint count;
+
+    pixbuf = gtk_icon_info_load_icon_finish (GTK_ICON_INFO (source), res, &err);
+    if (!pixbuf)
+    {
+        if (!g_error_matches (err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) g_hash_table_remove (icon_cache, req->key);
+        g_error_free (err);
+    }
+    else
+    {
+        trace_end ("load_icon", req->name, req->start);
+
+        /* ignore icons loaded for a size, scale or theme which is no longer in use */
+        if (g_hash_table_contains (icon_cache, req->key))
+        {
+            surface = gdk_cairo_surface_create_from_pixbuf (pixbuf, req->scale, NULL);
+            g_hash_table_replace (icon_cache, g_strdup (req->key), surface);
+
+            for (count = 0; count < tabs->len; count++)
+            {
+                tdata = g_ptr_array_index (tabs, count);
+                if (!g_strcmp0 (tdata->icon_name, req->name)) gtk_image_set_from_surface (GTK_IMAGE (tdata->icon), surface);
+            }
+        }
+        g_object_unref (pixbuf);
+    }
+
+    g_free (req->key);
+    g_free (req->name);
+    g_free (req);
+}
+
+static void update_icons (GtkWidget *, gpointer)
+{
+    PangoFontDescription *font_desc;
+    GtkStyleContext *sc;
+    int size, scale;
+    char *theme;
+    guint count;
+    gint64 start;
+
+    start = trace_begin ();
+    sc = gtk_widget_get_style_context (nb);
+    gtk_style_context_get (sc, gtk_style_context_get_state (sc), GTK_STYLE_PROPERTY_FONT, &font_desc, NULL);
+    size = pango_font_description_get_size (font_desc) / PANGO_SCALE < 12 ? 24 : 32;
+    pango_font_description_free (font_desc);
+    scale = gtk_widget_get_scale_factor (dlg);
+    g_object_get (gtk_settings_get_default (), "gtk-icon-theme-name", &theme, NULL);
+
+    if (size == icon_size && scale == icon_scale && !g_strcmp0 (theme, icon_theme))
+    {
+        g_free (theme);
+        return;
+    }
+
+    icon_size = size;
+    icon_scale = scale;
+    g_free (icon_theme);
+    icon_theme = theme;
+    g_hash_table_remove_all (icon_cache);
+
+    for (count = 0; count < tabs->len; count++) load_icon (g_ptr_array_index (tabs, count));
+    trace_end ("update_icons", NULL, start);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Tab visibility */
+/*----------------------------------------------------------------------------*/
+
+/* Plugins which export tab_visible are told when each of their tabs is shown and hidden -
+ * a tab is only visible while it is the current page of a window which is mapped and not
+ * minimised - and those which export window_active are told when the window gains and
+ * loses focus, so that they can stop polling while nothing can be seen. */
+
+static void update_visible_tab (GtkWidget *page)
+{
+    tab_t *tdata = NULL;
+    GdkWindow *win;
+
+    win = gtk_widget_get_window (dlg);
+    if (gtk_widget_get_mapped (dlg) && win && !(gdk_window_get_state (win) & GDK_WINDOW_STATE_ICONIFIED))
+    {
+        if (!page) page = gtk_notebook_get_nth_page (GTK_NOTEBOOK (nb), gtk_notebook_get_current_page (GTK_NOTEBOOK (nb)));
+        if (page) tdata = g_object_get_data (G_OBJECT (page), "tab");
+        if (tdata && !tdata->built) tdata = NULL;
+    }
+    if (tdata == visible_tab) return;
+
+    if (visible_tab && visible_tab->built && visible_tab->plugin->desc.tab_visible)
+        visible_tab->plugin->desc.tab_visible (visible_tab->tab, FALSE);
+    visible_tab = tdata;
+    if (visible_tab && visible_tab->plugin->desc.tab_visible)
+        visible_tab->plugin->desc.tab_visible (visible_tab->tab, TRUE);
+
+    trace_mark ("visible_tab", visible_tab ? visible_tab->name : NULL);
+}
+
+static gboolean window_state (GtkWidget *, GdkEvent *, gpointer)
+{
+    update_visible_tab (NULL);
+    return FALSE;
+}
+
+static void window_active (GObject *, GParamSpec *, gpointer)
+{
+    gboolean active = gtk_window_is_active (GTK_WINDOW (dlg));
+    plugin_t *plugin;
+    GList *l;
+
+    for (l = plugins; l; l = l->next)
+    {
+        plugin = (plugin_t *) l->data;
+        if (plugin->phandle && plugin->desc.window_active) plugin->desc.window_active (active);
+    }
+}
+
+/* Timers which plugins create with plugin_timeout_add are counted when tracing, as a
+ * total and while none of the plugin's tabs is visible, to find plugins which poll */
+
+static gboolean wakeup_dispatch (gpointer data)
+{
+    wakeup_t *wk = (wakeup_t *) data;
+    char *name;
+
+    wk->plugin->wakeups++;
+    if (!visible_tab || visible_tab->plugin != wk->plugin) wk->plugin->hidden_wakeups++;
+
+    name = g_strdup_printf ("wakeups %s", wk->plugin->path);
+    trace_counter (name, wk->plugin->wakeups);
+    g_free (name);
+    name = g_strdup_printf ("hidden_wakeups %s", wk->plugin->path);
+    trace_counter (name, wk->plugin->hidden_wakeups);
+    g_free (name);
+
+    return wk->func (wk->data);
+}
+
+guint plugin_timeout_add (unsigned int interval, GSourceFunc func, void *data)
+{
+    plugin_t *plugin;
+    wakeup_t *wk;
+    Dl_info info;
+    GList *l;
+
+    if (trace_buf && dladdr (func, &info) && info.dli_fname)
+    {
+        for (l = plugins; l; l = l->next)
+        {
+            plugin = (plugin_t *) l->data;
+            if (g_strcmp0 (plugin->path, info.dli_fname)) continue;
+
+            wk = g_new0 (wakeup_t, 1);
+            wk->func = func;
+            wk->data = data;
+            wk->plugin = plugin;
+            return g_timeout_add_full (G_PRIORITY_DEFAULT, interval, wakeup_dispatch, wk, g_free);
+        }
+    }
+    return g_timeout_add (interval, func, data);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Tab hibernation */
+/*----------------------------------------------------------------------------*/
+
+/* Tabs of plugins which support it are released once they have not been shown for
+ * hibernate_secs seconds (set with "hibernate" in config.ini, 0 to disable), and are
+ * rebuilt with get_tab when they are next selected */
+
+static long rss_kb (void)
+{
+    FILE *fp;
+    long size, rss = 0;
+
+    if ((fp = fopen ("/proc/self/statm", "r")))
+    {
+        if (fscanf (fp, "%ld %ld", &size, &rss) != 2) rss = 0;
+        fclose (fp);
+    }
+    return rss * (sysconf (_SC_PAGESIZE) / 1024);
+}
+
+static void mark_tab_shown (GtkWidget *page)
+{
+    tab_t *tdata;
+
+    if (page && (tdata = g_object_get_data (G_OBJECT (page), "tab"))) tdata->last_shown = g_get_monotonic_time ();
+}
+
+static void hibernate_tab (tab_t *tdata)
+{
+    gint64 start;
+    long freed;
+    char *detail;
+
+    start = trace_begin ();
+    freed = rss_kb ();
+
+    gtk_container_foreach (GTK_CONTAINER (tdata->page), (GtkCallback) gtk_widget_destroy, NULL);
+    tdata->built = FALSE;
+    tdata->plugin->desc.release_tab (tdata->tab);
+
+    /* hand the freed heap back to the system so the saving shows in the RSS */
+    malloc_trim (0);
+
+    freed -= rss_kb ();
+    hibernate_kb += freed;
+    detail = g_strdup_printf ("%s (%ld kB)", tdata->name, freed);
+    trace_end ("release_tab", detail, start);
+    trace_counter ("hibernate_reclaimed_kb", hibernate_kb);
+    g_free (detail);
+}
+
+static gboolean hibernate_check (gpointer)
+{
+    GtkWidget *cur;
+    tab_t *tdata;
+    gint64 limit;
+    guint i;
+
+    limit = g_get_monotonic_time () - hibernate_secs * G_USEC_PER_SEC;
+    cur = gtk_notebook_get_nth_page (GTK_NOTEBOOK (nb), gtk_notebook_get_current_page (GTK_NOTEBOOK (nb)));
+    for (i = 0; i < tabs->len; i++)
+    {
+        tdata = g_ptr_array_index (tabs, i);
+        if (!tdata->built || !tdata->plugin->desc.release_tab || !(tdata->plugin->desc.flags & RPCC_PLUGIN_RELEASE_TAB)) continue;
+        if (tdata->page == cur && gtk_widget_get_visible (dlg)) continue;
+        if (tdata->last_shown < limit) hibernate_tab (tdata);
+    }
+    return TRUE;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Memory report */
+/*----------------------------------------------------------------------------*/
+
+/* If RPCC_MEM_REPORT is set, the change in heap use and RSS caused by each stage of
+ * loading and unloading each plugin is recorded, and a table of the totals for each
+ * plugin is written to stderr at exit and on SIGUSR1. Startup is run on the main thread
+ * alone while this is enabled, so that other threads do not affect the figures. */
+
+static const char * const mem_stages[] = { "dlopen", "prefetch", "init", "get_tab", "free" };
+
+static long heap_kb (void)
+{
+    struct mallinfo2 mi = mallinfo2 ();
+
+    return (mi.uordblks + mi.hblkhd) / 1024;
+}
+
+static void mem_begin (mem_sample_t *mem)
+{
+    if (!mem_report) return;
+    mem->heap = heap_kb ();
+    mem->rss = rss_kb ();
+}
+
+static void mem_end (plugin_t *plugin, mem_stage stage, mem_sample_t *mem)
+{
+    if (!mem_report) return;
+    plugin->mem[stage].heap += heap_kb () - mem->heap;
+    plugin->mem[stage].rss += rss_kb () - mem->rss;
+}
+
+static void mem_write (void)
+{
+    plugin_t *plugin;
+    GList *l;
+    int stage;
+
+    fprintf (stderr, "\nrpcc memory report - heap / RSS change in kB\n%-32s", "plugin");
+    for (stage = 0; stage < MEM_STAGES; stage++) fprintf (stderr, " %15s", mem_stages[stage]);
+    fprintf (stderr, "\n");
+
+    for (l = plugins; l; l = l->next)
+    {
+        plugin = (plugin_t *) l->data;
+        fprintf (stderr, "%-32s", strrchr (plugin->path, '/') ? strrchr (plugin->path, '/') + 1 : plugin->path);
+        for (stage = 0; stage < MEM_STAGES; stage++)
+            fprintf (stderr, " %7ld/%7ld", plugin->mem[stage].heap, plugin->mem[stage].rss);
+        fprintf (stderr, "\n");
+    }
+
+    fprintf (stderr, "total heap %ld kB, RSS %ld kB\n", heap_kb (), rss_kb ());
+}
+
+static gboolean mem_signal (gpointer)
+{
+    mem_write ();
+    return G_SOURCE_CONTINUE;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Watchdog */
+/*----------------------------------------------------------------------------*/
+
+/* If RPCC_WATCHDOG is set to a number of milliseconds, a thread watches for the main loop
+ * being blocked for longer than that. When it is, the main thread is signalled to record
+ * its stack, which is searched for the plugin function which was running. Each stall is
+ * logged to stderr as it happens, and a summary of them is written at exit. */
+
+static void watchdog_signal (int)
+{
+    stall_depth = backtrace (stall_frames, WATCHDOG_FRAMES);
+}
+
+static gboolean watchdog_beat (gpointer)
+{
+    g_atomic_int_set (&watchdog_time, (g_get_monotonic_time () - watchdog_origin) / 1000);
+    return TRUE;
+}
+
+static char *watchdog_where (void)
+{
+    Dl_info info;
+    int i;
+
+    /* the innermost frame in a plugin is the one responsible */
+    for (i = 0; i < stall_depth; i++)
+    {
+        if (!dladdr (stall_frames[i], &info) || !info.dli_fname) continue;
+        if (!g_str_has_prefix (info.dli_fname, plugin_path)) continue;
+        if (info.dli_sname) return g_strdup_printf ("%s (%s)", info.dli_fname, info.dli_sname);
+        return g_strdup_printf ("%s (+%#lx)", info.dli_fname, (unsigned long) ((char *) stall_frames[i] - (char *) info.dli_fbase));
+    }
+
+    /* otherwise the innermost named function, skipping the signal handler */
+    for (i = 2; i < stall_depth; i++)
+    {
+        if (dladdr (stall_frames[i], &info) && info.dli_sname)
+            return g_strdup_printf ("%s (%s)", info.dli_fname, info.dli_sname);
+    }
+    return g_strdup ("unknown");
+}
+
+static void watchdog_record (const char *where, int start, int end)
+{
+    stall_t *stall;
+
+    stall = g_hash_table_lookup (stall_summary, where);
+    if (!stall)
+    {
+        stall = g_new0 (stall_t, 1);
+        g_hash_table_insert (stall_summary, g_strdup (where), stall);
+    }
+    stall->count++;
+    stall->total_ms += end - start;
+    if (end - start > stall->max_ms) stall->max_ms = end - start;
+
+    if (trace_buf) trace_add ('X', "stall", where, watchdog_origin + start * (gint64) 1000, watchdog_origin + end * (gint64) 1000);
+}
+
+static gpointer watchdog_thread (gpointer)
+{
+    char *where = NULL;
+    int now, beat, start = 0, i;
+
+    while (!g_atomic_int_get (&watchdog_stop))
+    {
+        g_usleep (watchdog_ms * 250);
+        now = (g_get_monotonic_time () - watchdog_origin) / 1000;
+        beat = g_atomic_int_get (&watchdog_time);
+
+        if (now - beat < watchdog_ms)
+        {
+            /* the main loop is running again - the stall lasted until its first beat */
+            if (where)
+            {
+                watchdog_record (where, start, beat);
+                g_free (where);
+                where = NULL;
+            }
+            continue;
+        }
+        if (where) continue;
+
+        stall_depth = -1;
+        syscall (SYS_tgkill, getpid (), main_tid, SIGUSR2);
+        for (i = 0; i < 100 && stall_depth < 0; i++) g_usleep (1000);
+
+        where = stall_depth > 0 ? watchdog_where () : g_strdup ("unknown");
+        start = beat;
+        fprintf (stderr, "Main loop blocked for %d ms in %s\n", now - beat, where);
+    }
+
+    if (where)
+    {
+        watchdog_record (where, start, (g_get_monotonic_time () - watchdog_origin) / 1000);
+        g_free (where);
+    }
+    return NULL;
+}
+
+static void watchdog_start (void)
+{
+    struct sigaction sa;
+    const char *env = getenv ("RPCC_WATCHDOG");
+
+    if (!env || (watchdog_ms = atoi (env)) <= 0) return;
+
+    /* load the unwinder now rather than in the signal handler */
+    stall_depth = backtrace (stall_frames, WATCHDOG_FRAMES);
+
+    memset (&sa, 0, sizeof (sa));
+    sa.sa_handler = watchdog_signal;
+    sa.sa_flags = SA_RESTART;
+    sigaction (SIGUSR2, &sa, NULL);
+
+    main_tid = syscall (SYS_gettid);
+    watchdog_origin = g_get_monotonic_time ();
+    stall_summary = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    g_timeout_add (MAX (watchdog_ms / 4, 1), watchdog_beat, NULL);
+    watchdog = g_thread_new ("watchdog", watchdog_thread, NULL);
+}
+
+static void watchdog_end (void)
+{
+    GHashTableIter iter;
+    gpointer key, value;
+    stall_t *stall;
+
+    if (!watchdog) return;
+    g_atomic_int_set (&watchdog_stop, 1);
+    g_thread_join (watchdog);
+    watchdog = NULL;
+
+    if (g_hash_table_size (stall_summary))
+    {
+        fprintf (stderr, "\nrpcc main loop stalls over %d ms\n%8s %10s %10s  %s\n", watchdog_ms, "count", "max ms", "total ms", "where");
+        g_hash_table_iter_init (&iter, stall_summary);
+        while (g_hash_table_iter_next (&iter, &key, &value))
+        {
+            stall = (stall_t *) value;
+            fprintf (stderr, "%8d %10d %10d  %s\n", stall->count, stall->max_ms, stall->total_ms, (char *) key);
+        }
+    }
+    g_hash_table_destroy (stall_summary);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Readahead */
+/*----------------------------------------------------------------------------*/
+
+/* Plugins and the libraries they need are read into the page cache by a worker thread
+ * started at the top of main, so that the disk is busy while GTK initialises rather than
+ * being read a page at a time by the page faults of dlopen. Libraries which rpcc has
+ * already loaded are skipped. Needed libraries are looked for in the directory holding
+ * the plugin directory, which is the multiarch library directory when installed. */
+
+static int readahead_loaded (struct dl_phdr_info *info, size_t, void *data)
+{
+    if (info->dlpi_name && *info->dlpi_name)
+        g_hash_table_add ((GHashTable *) data, g_path_get_basename (info->dlpi_name));
+    return 0;
+}
+
+static void readahead_needed (const char *map, size_t len, GHashTable *seen, GQueue *todo, const char *libdir)
+{
+    const ElfW(Ehdr) *eh = (const ElfW(Ehdr) *) map;
+    const ElfW(Phdr) *ph;
+    const ElfW(Dyn) *dyn = NULL;
+    ElfW(Addr) strtab = 0;
+    size_t ndyn = 0, stroff = 0, i;
+    const char *name;
+    char *path;
+
+    if (len < sizeof (ElfW(Ehdr)) || memcmp (eh->e_ident, ELFMAG, SELFMAG)) return;
+    if (eh->e_ident[EI_CLASS] != (sizeof (void *) == 8 ? ELFCLASS64 : ELFCLASS32)) return;
+    if (eh->e_phoff + eh->e_phnum * sizeof (ElfW(Phdr)) > len) return;
+
+    ph = (const ElfW(Phdr) *) (map + eh->e_phoff);
+    for (i = 0; i < eh->e_phnum; i++)
+    {
+        if (ph[i].p_type == PT_DYNAMIC && ph[i].p_offset + ph[i].p_filesz <= len)
+        {
+            dyn = (const ElfW(Dyn) *) (map + ph[i].p_offset);
+            ndyn = ph[i].p_filesz / sizeof (ElfW(Dyn));
+        }
+    }
+    if (!dyn) return;
+
+    for (i = 0; i < ndyn && dyn[i].d_tag != DT_NULL; i++)
+        if (dyn[i].d_tag == DT_STRTAB) strtab = dyn[i].d_un.d_ptr;
+
+    /* the string table is given as an address, so find the file offset from the segment holding it */
+    for (i = 0; i < eh->e_phnum && !stroff; i++)
+    {
+        if (ph[i].p_type == PT_LOAD && strtab >= ph[i].p_vaddr && strtab < ph[i].p_vaddr + ph[i].p_filesz)
+            stroff = strtab - ph[i].p_vaddr + ph[i].p_offset;
+    }
+    if (!stroff) return;
+
+    for (i = 0; i < ndyn && dyn[i].d_tag != DT_NULL; i++)
+    {
+        if (dyn[i].d_tag != DT_NEEDED || stroff + dyn[i].d_un.d_val >= len) continue;
+        name = map + stroff + dyn[i].d_un.d_val;
+        if (!memchr (name, 0, len - (stroff + dyn[i].d_un.d_val))) continue;
+        if (g_hash_table_contains (seen, name)) continue;
+        g_hash_table_add (seen, g_strdup (name));
+
+        path = g_build_filename (libdir, name, NULL);
+        if (!g_file_test (path, G_FILE_TEST_EXISTS))
+        {
+            g_free (path);
+            path = g_build_filename ("/usr/lib", name, NULL);
+        }
+        g_queue_push_tail (todo, path);
+    }
+}
+
+static gpointer readahead_thread (gpointer)
+{
+    GHashTable *seen;
+    GQueue todo = G_QUEUE_INIT;
+    DIR *d;
+    struct dirent *dir;
+    struct stat st;
+    char *path, *libdir, *map;
+    gint64 start;
+    int fd;
+
+    start = trace_begin ();
+    seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    dl_iterate_phdr (readahead_loaded, seen);
+
+    if ((d = opendir (plugin_path)))
+    {
+        while ((dir = readdir (d)))
+            if (strstr (dir->d_name, ".so")) g_queue_push_tail (&todo, g_build_filename (plugin_path, dir->d_name, NULL));
+        closedir (d);
+    }
+
+    path = g_canonicalize_filename (plugin_path, "/");
+    libdir = g_path_get_dirname (path);
+    g_free (path);
+
+    while ((path = g_queue_pop_head (&todo)))
+    {
+        fd = open (path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0 && !fstat (fd, &st) && st.st_size > 0)
+        {
+            readahead (fd, 0, st.st_size);
+            map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED)
+            {
+                readahead_needed (map, st.st_size, seen, &todo, libdir);
+                munmap (map, st.st_size);
+            }
+        }
+        if (fd >= 0) close (fd);
+        g_free (path);
+    }
+
+    g_free (libdir);
+    g_hash_table_destroy (seen);
+    trace_end ("readahead", NULL, start);
+    return NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Plugin manifest */
+/*----------------------------------------------------------------------------*/
+
+/* The tab names, ids and icons of each plugin are cached, so that the notebook can be
+ * populated at startup without loading any plugin - plugins are then only loaded when one
+ * of their tabs is first shown. Entries are keyed on the modification time and size of
+ * the plugin and on the locale, so are rebuilt whenever a plugin is updated. */
+
+/* Whether name is the name of a built-in plugin or, given a suffix, whether name less suffix
+ * is the file name the plugin was built from - which may contain '-' where its name has '_' */
+static gboolean is_builtin (const char *name, const char *suffix)
+{
+    const char *match;
+    int i, len;
+
+    for (i = 0; builtin_plugins[i].name; i++)
+    {
+        match = *suffix ? builtin_plugins[i].file : builtin_plugins[i].name;
+        len = strlen (match);
+        if (!strncmp (name, match, len) && !g_strcmp0 (name + len, suffix)) return TRUE;
+    }
+    return FALSE;
+}
+
+/* Takes ownership of path; built-in plugins are keyed on the binary they are part of */
+static plugin_t *scan_plugin (char *path, const rpcc_plugin_t *(*builtin) (void), GKeyFile *kf, gboolean *changed)
+{
+    plugin_t *plugin;
+    struct stat st;
+    char *str, *name, *id, *icon;
+    const char *locale;
+    gboolean cached;
+    int tab, tabs;
+
+    if (stat (builtin ? "/proc/self/exe" : path, &st))
+    {
+        g_free (path);
+        return NULL;
+    }
+
+    plugin = g_new0 (plugin_t, 1);
+    plugin->path = path;
+    plugin->builtin = builtin;
+    locale = setlocale (LC_MESSAGES, NULL);
+
+    cached = FALSE;
+    if (g_key_file_has_group (kf, path)
+        && g_key_file_get_int64 (kf, path, "mtime", NULL) == st.st_mtime
+        && g_key_file_get_int64 (kf, path, "size", NULL) == st.st_size)
+    {
+        str = g_key_file_get_string (kf, path, "locale", NULL);
+        cached = !g_strcmp0 (str, locale);
+        g_free (str);
+    }
+
+    if (cached)
+    {
+        tabs = g_key_file_get_integer (kf, path, "tabs", NULL);
+        if (tabs < 1)
+        {
+            g_free (plugin->path);
+            g_free (plugin);
+            return NULL;
+        }
+
+        /* plugins which need all tabs built up front are still loaded at startup */
+        if (!g_key_file_get_boolean (kf, path, "lazy", NULL)) return plugin;
+        plugin->desc.flags = RPCC_PLUGIN_LAZY_TABS;
+
+        for (tab = 0; tab < tabs; tab++)
+        {
+            str = g_strdup_printf ("name_%d", tab);
+            name = g_key_file_get_string (kf, path, str, NULL);
+            g_free (str);
+            str = g_strdup_printf ("id_%d", tab);
+            id = g_key_file_get_string (kf, path, str, NULL);
+            g_free (str);
+            str = g_strdup_printf ("icon_%d", tab);
+            icon = g_key_file_get_string (kf, path, str, NULL);
+            g_free (str);
+
+            add_tab (plugin, tab, name, id, icon);
+
+            g_free (name);
+            g_free (id);
+            g_free (icon);
+        }
+
+        plugins = g_list_append (plugins, plugin);
+        return NULL;
+    }
+
+    /* the entry is completed once the plugin has loaded, and dropped if it fails to */
+    g_key_file_remove_group (kf, path, NULL);
+    g_key_file_set_int64 (kf, path, "mtime", st.st_mtime);
+    g_key_file_set_int64 (kf, path, "size", st.st_size);
+    g_key_file_set_string (kf, path, "locale", locale);
+    g_key_file_set_integer (kf, path, "tabs", 0);
+    *changed = TRUE;
+
+    return plugin;
+}
+
+static void add_plugin_tabs (plugin_t *plugin, GKeyFile *kf)
+{
+    char *str;
+    int tab, tabs;
+
+    tabs = plugin->desc.plugin_tabs ();
+    g_key_file_set_boolean (kf, plugin->path, "lazy", (plugin->desc.flags & RPCC_PLUGIN_LAZY_TABS) != 0);
+    g_key_file_set_integer (kf, plugin->path, "tabs", tabs);
+    for (tab = 0; tab < tabs; tab++)
+    {
+        str = g_strdup_printf ("name_%d", tab);
+        g_key_file_set_string (kf, plugin->path, str, plugin->desc.tab_name (tab));
+        g_free (str);
+        if (plugin->desc.tab_id (tab))
+        {
+            str = g_strdup_printf ("id_%d", tab);
+            g_key_file_set_string (kf, plugin->path, str, plugin->desc.tab_id (tab));
+            g_free (str);
+        }
+        str = g_strdup_printf ("icon_%d", tab);
+        g_key_file_set_string (kf, plugin->path, str, plugin->desc.icon_name (tab));
+        g_free (str);
+
+        add_tab (plugin, tab, plugin->desc.tab_name (tab), plugin->desc.tab_id (tab), plugin->desc.icon_name (tab));
+    }
+
+    plugins = g_list_append (plugins, plugin);
+}
+
+static gboolean manifest_has_tab (GKeyFile *kf, const char *path, const char *id)
+{
+    char *str, *val;
+    gboolean found = FALSE;
+    int tab, tabs;
+
+    if (!id) return FALSE;
+    if (!g_strcmp0 (id, "wifi_country")) id = "localisation";
+
+    tabs = g_key_file_get_integer (kf, path, "tabs", NULL);
+    for (tab = 0; tab < tabs && !found; tab++)
+    {
+        str = g_strdup_printf ("id_%d", tab);
+        val = g_key_file_get_string (kf, path, str, NULL);
+        found = !g_strcmp0 (val, id);
+        g_free (val);
+        g_free (str);
+    }
+    return found;
+}
+
+/* Plugins which must be loaded at startup are loaded one per idle callback, so that the
+ * window is responsive and each plugin's tabs appear as soon as it is ready. Prefetch
+ * functions run in parallel on worker threads, and the plugin is initialised back on
+ * the main thread when its prefetch has finished. */
+
+static void plugin_ready (plugin_t *plugin)
+{
+    if (plugin->desc.prefetch_plugin && !prefetch_threaded (plugin)) run_prefetch (plugin);
+    start_plugin (plugin);
+    add_plugin_tabs (plugin, manifest);
+    find_start_tab ();
+}
+
+static gboolean prefetch_done (gpointer data)
+{
+    /* loading was abandoned because the window was closed */
+    if (!load_pool) return FALSE;
+
+    load_pending--;
+    plugin_ready ((plugin_t *) data);
+    if (!load_pending && !load_id) finish_loading ();
+    return FALSE;
+}
+
+static void prefetch_thread (gpointer data, gpointer)
+{
+    run_prefetch ((plugin_t *) data);
+    g_idle_add (prefetch_done, data);
+}
+
+static gboolean prefetch_threaded (plugin_t *plugin)
+{
+    if (!plugin->desc.prefetch_plugin || mem_report) return FALSE;
+    return (plugin->desc.flags & RPCC_PLUGIN_THREADED_PREFETCH) != 0;
+}
+
+static gboolean load_next (gpointer)
+{
+    plugin_t *plugin;
+
+    if ((plugin = g_queue_pop_head (&load_queue)))
+    {
+        if (!open_plugin (plugin))
+        {
+            /* not recorded, so that it is tried again next time - it may only be missing a library */
+            g_key_file_remove_group (manifest, plugin->path, NULL);
+            manifest_changed = TRUE;
+            g_free (plugin->path);
+            g_free (plugin);
+        }
+        else if (prefetch_threaded (plugin))
+        {
+            load_pending++;
+            g_thread_pool_push (load_pool, plugin, NULL);
+        }
+        else plugin_ready (plugin);
+    }
+
+    if (load_queue.length) return TRUE;
+
+    load_id = 0;
+    if (!load_pending) finish_loading ();
+    return FALSE;
+}
+
+static void queue_plugin (plugin_t *plugin)
+{
+    if (!plugin) return;
+    if (manifest_has_tab (manifest, plugin->path, st_tab)) g_queue_push_head (&load_queue, plugin);
+    else g_queue_push_tail (&load_queue, plugin);
+}
+
+static void scan_plugins (void)
+{
+    DIR *d;
+    struct dirent *dir;
+    char *cachefile, *path;
+    int i;
+
+    cachefile = g_build_filename (g_get_user_cache_dir (), "rpcc", "plugins.ini", NULL);
+    manifest = g_key_file_new ();
+    g_key_file_load_from_file (manifest, cachefile, G_KEY_FILE_NONE, NULL);
+    g_free (cachefile);
+
+    /* cached tabs are added now; the tab asked for on the command line is loaded first */
+    for (i = 0; builtin_plugins[i].name; i++)
+    {
+        path = g_strconcat (BUILTIN_PREFIX, builtin_plugins[i].name, NULL);
+        queue_plugin (scan_plugin (path, builtin_plugins[i].descriptor, manifest, &manifest_changed));
+    }
+
+    /* a built-in plugin takes the place of an installed copy of the same plugin */
+    if ((d = opendir (plugin_path)))
+    {
+        while ((dir = readdir (d)))
+        {
+            if (!strstr (dir->d_name, ".so") || is_builtin (dir->d_name, ".so")) continue;
+            path = g_build_filename (plugin_path, dir->d_name, NULL);
+            queue_plugin (scan_plugin (path, NULL, manifest, &manifest_changed));
+        }
+        closedir (d);
+    }
+
+    load_pool = g_thread_pool_new (prefetch_thread, NULL, g_get_num_processors (), FALSE, NULL);
+    load_id = g_idle_add (load_next, NULL);
+}
+
+static void finish_loading (void)
+{
+    char *cachefile, *str, **groups;
+    gsize len;
+    int i;
+
+    g_thread_pool_free (load_pool, FALSE, TRUE);
+    load_pool = NULL;
+
+    if (!tab_set && !page_switched && saved_tab >= 0) gtk_notebook_set_current_page (GTK_NOTEBOOK (nb), saved_tab);
+    saved_tab = -1;
+
+    /* drop entries for plugins which have been removed */
+    groups = g_key_file_get_groups (manifest, NULL);
+    for (i = 0; groups[i]; i++)
+    {
+        if (g_str_has_prefix (groups[i], BUILTIN_PREFIX) ? !is_builtin (groups[i] + strlen (BUILTIN_PREFIX), "")
+            : !g_file_test (groups[i], G_FILE_TEST_EXISTS))
+        {
+            g_key_file_remove_group (manifest, groups[i], NULL);
+            manifest_changed = TRUE;
+        }
+    }
+    g_strfreev (groups);
+
+    if (manifest_changed)
+    {
+        cachefile = g_build_filename (g_get_user_cache_dir (), "rpcc", "plugins.ini", NULL);
+        str = g_path_get_dirname (cachefile);
+        g_mkdir_with_parents (str, S_IRUSR | S_IWUSR | S_IXUSR);
+        g_free (str);
+
+        str = g_key_file_to_data (manifest, &len, NULL);
+        g_file_set_contents (cachefile, str, len, NULL);
+        g_free (str);
+        g_free (cachefile);
+    }
+
+    g_key_file_free (manifest);
+    manifest = NULL;
+    trace_mark ("plugins_loaded", NULL);
+}
+
+static void stop_loading (void)
+{
+    plugin_t *plugin;
+
+    if (load_id) g_source_remove (load_id);
+    load_id = 0;
+    while ((plugin = g_queue_pop_head (&load_queue)))
+    {
+        g_free (plugin->path);
+        g_free (plugin);
+    }
+    if (load_pool) g_thread_pool_free (load_pool, TRUE, TRUE);
+    load_pool = NULL;
+    if (manifest) g_key_file_free (manifest);
+    manifest = NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Shared config files */
+/*----------------------------------------------------------------------------*/
+
+/* Line-based key=value files (config.txt, ini-style compositor configs) are read once
+ * and served to all plugins from memory. A file monitor drops the cached copy if the file
+ * is changed by anything else. Changes from plugins are queued, and written back shortly
+ * afterwards as one atomic rewrite of each file - the file is re-read and all the queued
+ * changes applied to it at that point, so plugins do not overwrite each other's edits.
+ *
+ * Keys outside any section, or in the [all] section, are matched when section is NULL;
+ * as in config.txt, the last matching line is the one which takes effect. Keys such as
+ * dtoverlay and dtparam, which may appear many times with every line taking effect, are
+ * given as "key=name" to match only the line whose value starts with that name - so
+ * "dtparam=audio" matches "dtparam=audio=on", and "dtoverlay=vc4-kms-v3d" matches
+ * "dtoverlay=vc4-kms-v3d,cma-256". */
+
+static char *conf_trim (const char *str, int len)
+{
+    while (len > 0 && g_ascii_isspace (*str)) str++, len--;
+    while (len > 0 && g_ascii_isspace (str[len - 1])) len--;
+    return g_strndup (str, len);
+}
+
+static gboolean conf_in_section (const char *cur, const char *section)
+{
+    if (section) return !g_strcmp0 (cur, section);
+    return !cur || !g_strcmp0 (cur, "all");
+}
+
+/* Whether the line with the given key and value (the text after the '=') is matched by key */
+static gboolean conf_match (const char *name, const char *value, const char *key)
+{
+    const char *item = strchr (key, '=');
+    int len;
+
+    if (!item) return !g_strcmp0 (name, key);
+    if (strlen (name) != (size_t) (item - key) || strncmp (name, key, item - key)) return FALSE;
+
+    item++;
+    while (g_ascii_isspace (*value)) value++;
+    len = strcspn (value, ",:= \t");
+    return len == (int) strlen (item) && !strncmp (value, item, len);
+}
+
+/* Returns the index of the last line setting key in section, or -1; if end is not NULL,
+ * it is set to the index after the last line of the section, or -1 if not found */
+static int conf_find (GPtrArray *lines, const char *section, const char *key, int *end)
+{
+    char *cur = NULL, *name, *eq;
+    const char *line;
+    int i, found = -1;
+
+    if (end) *end = section ? -1 : (int) lines->len;
+    for (i = 0; i < lines->len; i++)
+    {
+        line = g_ptr_array_index (lines, i);
+        while (g_ascii_isspace (*line)) line++;
+        if (*line == '[')
+        {
+            g_free (cur);
+            cur = conf_trim (line + 1, strcspn (line + 1, "]"));
+            if (end && section && conf_in_section (cur, section)) *end = i + 1;
+            continue;
+        }
+        if (end && section && conf_in_section (cur, section)) *end = i + 1;
+        if (*line == '#' || *line == ';' || !(eq = strchr (line, '='))) continue;
+
+        name = conf_trim (line, eq - line);
+        if (conf_in_section (cur, section) && conf_match (name, eq + 1, key)) found = i;
+        g_free (name);
+    }
+
+    /* new keys for the default section go at the end, but only if that is not inside a conditional section */
+    if (end && !section && !conf_in_section (cur, NULL)) *end = -1;
+    g_free (cur);
+    return found;
+}
+
+static void conf_apply (GPtrArray *lines, conf_edit_t *edit)
+{
+    const char *line;
+    char *eq;
+    int index, end;
+
+    index = conf_find (lines, edit->section, edit->key, &end);
+    if (index >= 0)
+    {
+        if (!edit->value)
+        {
+            g_ptr_array_remove_index (lines, index);
+            return;
+        }
+
+        /* keep the key and separator exactly as they were, replacing only the value */
+        line = g_ptr_array_index (lines, index);
+        eq = strchr (line, '=') + 1;
+        while (*eq == ' ' || *eq == '\t') eq++;
+        g_ptr_array_index (lines, index) = g_strdup_printf ("%.*s%s", (int) (eq - line), line, edit->value);
+        g_free ((char *) line);
+        return;
+    }
+    if (!edit->value) return;
+
+    if (end < 0)
+    {
+        end = lines->len;
+        if (end > 0 && *((char *) g_ptr_array_index (lines, end - 1))) g_ptr_array_add (lines, g_strdup (""));
+        g_ptr_array_add (lines, g_strdup_printf ("[%s]", edit->section ? edit->section : "all"));
+        end = lines->len;
+    }
+    g_ptr_array_insert (lines, end, g_strdup_printf ("%.*s=%s", (int) strcspn (edit->key, "="), edit->key, edit->value));
+}
+
+static GPtrArray *conf_read (const char *path)
+{
+    GPtrArray *lines;
+    char *contents, **split;
+    int i;
+
+    lines = g_ptr_array_new_with_free_func (g_free);
+    if (g_file_get_contents (path, &contents, NULL, NULL))
+    {
+        split = g_strsplit (contents, "\n", -1);
+        for (i = 0; split[i]; i++)
+        {
+            /* don't create an extra empty line for the final newline */
+            if (!split[i + 1] && !*split[i]) break;
+            g_ptr_array_add (lines, g_strdup (split[i]));
+        }
+        g_strfreev (split);
+        g_free (contents);
+    }
+    return lines;
+}
+
+static void conf_changed (GFileMonitor *, GFile *, GFile *, GFileMonitorEvent event, gpointer data)
+{
+    conf_file_t *conf = (conf_file_t *) data;
+
+    if (event != G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT && event != G_FILE_MONITOR_EVENT_DELETED
+        && event != G_FILE_MONITOR_EVENT_CREATED) return;
+
+    /* queued edits are kept, and reapplied when the file is next read */
+    g_mutex_lock (&conf_lock);
+    if (conf->lines) g_ptr_array_unref (conf->lines);
+    conf->lines = NULL;
+    g_mutex_unlock (&conf_lock);
+}
+
+/* must be called with conf_lock held */
+static conf_file_t *conf_lookup (const char *path)
+{
+    conf_file_t *conf;
+    GFile *file;
+    guint i;
+
+    if (!conf_files) conf_files = g_hash_table_new (g_str_hash, g_str_equal);
+
+    conf = g_hash_table_lookup (conf_files, path);
+    if (!conf)
+    {
+        conf = g_new0 (conf_file_t, 1);
+        conf->path = g_strdup (path);
+        conf->edits = g_ptr_array_new ();
+
+        file = g_file_new_for_path (path);
+        conf->monitor = g_file_monitor_file (file, G_FILE_MONITOR_NONE, NULL, NULL);
+        if (conf->monitor) g_signal_connect (conf->monitor, "changed", G_CALLBACK (conf_changed), conf);
+        g_object_unref (file);
+
+        g_hash_table_insert (conf_files, conf->path, conf);
+    }
+
+    if (!conf->lines)
+    {
+        conf->lines = conf_read (path);
+        for (i = 0; i < conf->edits->len; i++) conf_apply (conf->lines, g_ptr_array_index (conf->edits, i));
+    }
+    return conf;
+}
+
+static void conf_free_edit (gpointer data)
+{
+    conf_edit_t *edit = (conf_edit_t *) data;
+
+    g_free (edit->section);
+    g_free (edit->key);
+    g_free (edit->value);
+    g_free (edit);
+}
+
+/* A file which does not exist yet can be written if the directory it is to go in can be */
+
+static gboolean conf_writable (const char *path)
+{
+    gboolean res;
+    char *dir;
+
+    if (!access (path, W_OK)) return TRUE;
+    if (errno != ENOENT) return FALSE;
+
+    dir = g_path_get_dirname (path);
+    res = !access (dir, W_OK);
+    g_free (dir);
+    return res;
+}
+
+static gboolean conf_write (const char *path, const char *contents, gsize len)
+{
+    invalidate_command_cache ();
+    if (conf_writable (path)) return g_file_set_contents (path, contents, len, NULL);
+
+    /* files owned by root are written with the other privileged changes */
+    queue_privileged_write (path, contents, len, NULL);
+    return TRUE;
+}
+
+static void conf_flush_file (gpointer, gpointer value, gpointer)
+{
+    conf_file_t *conf = (conf_file_t *) value;
+    GString *contents;
+    gboolean root;
+    guint i;
+
+    if (!conf->edits->len) return;
+
+    /* changes to files owned by root are kept pending until they are applied, so that
+     * later changes are made on top of them rather than on what is on disk */
+    root = !conf_writable (conf->path);
+    if (root && !priv_flush) return;
+
+    /* always start from what is on disk now, in case it has been changed by something else */
+    if (conf->lines) g_ptr_array_unref (conf->lines);
+    conf->lines = conf_read (conf->path);
+    for (i = 0; i < conf->edits->len; i++) conf_apply (conf->lines, g_ptr_array_index (conf->edits, i));
+
+    contents = g_string_new (NULL);
+    for (i = 0; i < conf->lines->len; i++)
+    {
+        g_string_append (contents, g_ptr_array_index (conf->lines, i));
+        g_string_append_c (contents, '\n');
+    }
+    if (!conf_write (conf->path, contents->str, contents->len))
+        fprintf (stderr, "Unable to write %s\n", conf->path);
+    g_string_free (contents, TRUE);
+
+    /* and are kept until the write has been made, in case it fails */
+    if (root)
+    {
+        conf->queued = conf->edits->len;
+        return;
+    }
+    g_ptr_array_foreach (conf->edits, (GFunc) conf_free_edit, NULL);
+    g_ptr_array_set_size (conf->edits, 0);
+}
+
+static void conf_applied (gpointer, gpointer value, gpointer)
+{
+    conf_file_t *conf = (conf_file_t *) value;
+    guint i;
+
+    for (i = 0; i < conf->queued; i++) conf_free_edit (g_ptr_array_index (conf->edits, i));
+    g_ptr_array_remove_range (conf->edits, 0, conf->queued);
+    conf->queued = 0;
+}
+
+/* Drops the edits kept for a file owned by root, so that the file is read again from disk */
+
+static void conf_discard (gpointer, gpointer value, gpointer)
+{
+    conf_file_t *conf = (conf_file_t *) value;
+
+    if (!conf->edits->len || conf_writable (conf->path)) return;
+    g_ptr_array_foreach (conf->edits, (GFunc) conf_free_edit, NULL);
+    g_ptr_array_set_size (conf->edits, 0);
+    conf->queued = 0;
+    if (conf->lines) g_ptr_array_unref (conf->lines);
+    conf->lines = NULL;
+}
+
+static gboolean conf_flush_timeout (gpointer)
+{
+    g_mutex_lock (&conf_lock);
+    conf_flush_id = 0;
+    g_mutex_unlock (&conf_lock);
+
+    config_file_flush ();
+    return FALSE;
+}
+
+char *config_file_get (const char *path, const char *section, const char *key)
+{
+    conf_file_t *conf;
+    const char *line;
+    char *val = NULL;
+    int index;
+
+    g_mutex_lock (&conf_lock);
+    conf = conf_lookup (path);
+    index = conf_find (conf->lines, section, key, NULL);
+    if (index >= 0)
+    {
+        line = g_ptr_array_index (conf->lines, index);
+        val = conf_trim (strchr (line, '=') + 1, strlen (strchr (line, '=') + 1));
+    }
+    g_mutex_unlock (&conf_lock);
+    return val;
+}
+
+void config_file_set (const char *path, const char *section, const char *key, const char *value)
+{
+    conf_file_t *conf;
+    conf_edit_t *edit;
+
+    g_mutex_lock (&conf_lock);
+    conf = conf_lookup (path);
+
+    edit = g_new0 (conf_edit_t, 1);
+    edit->section = g_strdup (section);
+    edit->key = g_strdup (key);
+    edit->value = g_strdup (value);
+    g_ptr_array_add (conf->edits, edit);
+    conf_apply (conf->lines, edit);
+
+    if (!conf_flush_id) conf_flush_id = g_timeout_add (CONF_FLUSH_MS, conf_flush_timeout, NULL);
+    g_mutex_unlock (&conf_lock);
+}
+
+void config_file_flush (void)
+{
+    g_mutex_lock (&conf_lock);
+    if (conf_flush_id)
+    {
+        g_source_remove (conf_flush_id);
+        conf_flush_id = 0;
+    }
+    if (conf_files) g_hash_table_foreach (conf_files, conf_flush_file, NULL);
+    g_mutex_unlock (&conf_lock);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Asynchronous commands */
+/*----------------------------------------------------------------------------*/
+
+/* Commands are run without blocking the main loop, one at a time in the order in which
+ * they were requested, as many change the same files. The busy cursor is shown while any
+ * command is queued or running. When the application is closed, the running and queued
+ * commands are run to completion, so that no change is lost or left half made, but their
+ * callbacks are not called. */
+
+static void cmd_busy (gboolean busy)
+{
+    if (!gtk_widget_get_window (dlg)) return;
+    if (busy) set_watch_cursor ();
+    else clear_watch_cursor ();
+}
+
+static void cmd_free (command_t *cmd)
+{
+    if (cmd->proc) g_object_unref (cmd->proc);
+    g_strfreev (cmd->argv);
+    g_free (cmd);
+}
+
+static void cmd_start (void)
+{
+    command_t *cmd;
+    GError *err = NULL;
+
+    while (!cmd_running && (cmd = g_queue_pop_head (&cmd_queue)))
+    {
+        cmd->proc = g_subprocess_newv ((const char * const *) cmd->argv, G_SUBPROCESS_FLAGS_STDOUT_PIPE | G_SUBPROCESS_FLAGS_STDERR_MERGE, &err);
+        if (!cmd->proc)
+        {
+            fprintf (stderr, "Unable to run %s - %s\n", cmd->argv[0], err->message);
+            g_clear_error (&err);
+            if (cmd->callback) cmd->callback (-1, NULL, cmd->data);
+            cmd_free (cmd);
+            continue;
+        }
+        cmd_running++;
+        cmd_active = g_list_append (cmd_active, cmd);
+        g_subprocess_communicate_utf8_async (cmd->proc, NULL, NULL, cmd_done, cmd);
+    }
+
+    if (!cmd_running && !cmd_queue.length) cmd_busy (FALSE);
+}
+
+static void cmd_done (GObject *, GAsyncResult *res, gpointer data)
+{
+    command_t *cmd = (command_t *) data;
+    char *output = NULL;
+    GError *err = NULL;
+    int status = -1;
+
+    cmd_running--;
+    cmd_active = g_list_remove (cmd_active, cmd);
+    if (g_subprocess_communicate_utf8_finish (cmd->proc, res, &output, NULL, &err))
+    {
+        if (g_subprocess_get_if_exited (cmd->proc)) status = g_subprocess_get_exit_status (cmd->proc);
+    }
+    else
+    {
+        fprintf (stderr, "Error running %s - %s\n", cmd->argv[0], err->message);
+        g_error_free (err);
+    }
+
+    invalidate_command_cache ();
+    if (cmd->callback) cmd->callback (status, output, cmd->data);
+    g_free (output);
+    cmd_free (cmd);
+
+    cmd_start ();
+}
+
+static int cmd_output (const char * const *argv, char **output)
+{
+    GSubprocess *proc;
+    GError *err = NULL;
+    int status = -1;
+
+    *output = NULL;
+    proc = g_subprocess_newv (argv, G_SUBPROCESS_FLAGS_STDOUT_PIPE | G_SUBPROCESS_FLAGS_STDERR_MERGE, &err);
+    if (proc)
+    {
+        if (g_subprocess_communicate_utf8 (proc, NULL, NULL, output, NULL, &err) && g_subprocess_get_if_exited (proc))
+            status = g_subprocess_get_exit_status (proc);
+        g_object_unref (proc);
+    }
+    if (err)
+    {
+        fprintf (stderr, "Error running %s - %s\n", argv[0], err->message);
+        g_error_free (err);
+    }
+    return status;
+}
+
+static void cmd_run_sync (const char * const *argv, command_callback callback, void *data)
+{
+    char *output;
+    int status;
+
+    status = cmd_output (argv, &output);
+    invalidate_command_cache ();
+
+    if (callback) callback (status, output, data);
+    g_free (output);
+}
+
+static void cmd_finish_all (void)
+{
+    GList *l;
+
+    for (l = cmd_active; l; l = l->next) ((command_t *) l->data)->callback = NULL;
+    for (l = cmd_queue.head; l; l = l->next) ((command_t *) l->data)->callback = NULL;
+
+    while (cmd_running || cmd_queue.length) g_main_context_iteration (NULL, TRUE);
+
+    /* commands from changes applied after this point are run straight away */
+    g_cancellable_cancel (cmd_cancel);
+}
+
+void run_command_async (const char * const *argv, command_callback callback, void *data)
+{
+    command_t *cmd;
+
+    /* once the application is closing, commands from pending changes are run to completion straight away */
+    if (g_cancellable_is_cancelled (cmd_cancel))
+    {
+        cmd_run_sync (argv, callback, data);
+        return;
+    }
+
+    cmd = g_new0 (command_t, 1);
+    cmd->argv = g_strdupv ((char **) argv);
+    cmd->callback = callback;
+    cmd->data = data;
+
+    if (!cmd_running && !cmd_queue.length) cmd_busy (TRUE);
+    g_queue_push_tail (&cmd_queue, cmd);
+    cmd_start ();
+}
+
+/*----------------------------------------------------------------------------*/
+/* Command cache */
+/*----------------------------------------------------------------------------*/
+
+/* The output of read-only commands which several plugins run, such as queries of the
+ * system configuration, is kept for a given time, so that each is only run once. A
+ * request for a command which is already running waits for it rather than running it
+ * again. The whole cache is dropped whenever a plugin changes anything through rpcc -
+ * writes a configuration file or runs a command with run_command_async. May be called
+ * from any thread. */
+
+static void cache_free (gpointer data)
+{
+    cache_entry_t *entry = (cache_entry_t *) data;
+
+    g_free (entry->output);
+    g_free (entry);
+}
+
+static void cache_count (gint *counter, const char *name)
+{
+    int val = g_atomic_int_add (counter, 1) + 1;
+
+    trace_counter (name, val);
+}
+
+char *run_command_cached (const char * const *argv, unsigned int ttl_ms, int *status)
+{
+    cache_entry_t *entry;
+    char *key, *output;
+    guint gen;
+    int res;
+
+    key = g_strjoinv ("\x1f", (char **) argv);
+
+    g_mutex_lock (&cache_lock);
+    if (!cache_table) cache_table = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, cache_free);
+    while ((entry = g_hash_table_lookup (cache_table, key)) && entry->running)
+        g_cond_wait (&cache_cond, &cache_lock);
+
+    if (entry && g_get_monotonic_time () < entry->expires)
+    {
+        output = g_strdup (entry->output);
+        if (status) *status = entry->status;
+        g_mutex_unlock (&cache_lock);
+        g_free (key);
+        cache_count (&cache_hits, "command_cache_hits");
+        return output;
+    }
+
+    if (!entry)
+    {
+        entry = g_new0 (cache_entry_t, 1);
+        g_hash_table_insert (cache_table, g_strdup (key), entry);
+    }
+    entry->running = TRUE;
+    gen = cache_gen;
+    g_mutex_unlock (&cache_lock);
+
+    cache_count (&cache_misses, "command_cache_misses");
+    res = cmd_output (argv, &output);
+
+    g_mutex_lock (&cache_lock);
+    g_free (entry->output);
+    entry->output = g_strdup (output);
+    entry->status = res;
+    entry->running = FALSE;
+
+    /* if something was changed while the command was running, its output may be stale */
+    entry->expires = gen == cache_gen ? g_get_monotonic_time () + ttl_ms * (gint64) 1000 : 0;
+    g_cond_broadcast (&cache_cond);
+    g_mutex_unlock (&cache_lock);
+
+    g_free (key);
+    if (status) *status = res;
+    return output;
+}
+
+void invalidate_command_cache (void)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    g_mutex_lock (&cache_lock);
+    cache_gen++;
+    if (cache_table)
+    {
+        /* running entries are left for their commands to complete, and then expire at once */
+        g_hash_table_iter_init (&iter, cache_table);
+        while (g_hash_table_iter_next (&iter, NULL, &value))
+            if (!((cache_entry_t *) value)->running) g_hash_table_iter_remove (&iter);
+    }
+    g_mutex_unlock (&cache_lock);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Deferred changes */
+/*----------------------------------------------------------------------------*/
+
+/* Plugins can post a change to be applied once a control has been left alone for a short
+ * time, rather than on every signal while it is being dragged. A change posted with the
+ * same key as one which is still pending replaces it. All pending changes are applied
+ * when the application is closed. */
+
+static void apply_free (apply_t *apply)
+{
+    if (apply->free_data) apply->free_data (apply->data);
+    g_free (apply->key);
+    g_free (apply);
+}
+
+static void apply_run (apply_t *apply)
+{
+    gint64 start;
+
+    g_hash_table_steal (apply_pending, apply->key);
+    if (apply->timer) g_source_remove (apply->timer);
+
+    start = trace_begin ();
+    apply->func (apply->data);
+    trace_end ("apply", apply->key, start);
+
+    apply_free (apply);
+}
+
+static gboolean apply_timeout (gpointer data)
+{
+    apply_t *apply = (apply_t *) data;
+
+    apply->timer = 0;
+    apply_run (apply);
+    return FALSE;
+}
+
+void schedule_apply (const char *key, apply_callback func, void *data, void (*free_data) (void *), int quiet_ms, int max_ms)
+{
+    apply_t *apply;
+    gint64 remaining;
+    int delay;
+
+    if (!apply_pending) apply_pending = g_hash_table_new (g_str_hash, g_str_equal);
+
+    apply = g_hash_table_lookup (apply_pending, key);
+    if (apply)
+    {
+        if (apply->free_data) apply->free_data (apply->data);
+        g_source_remove (apply->timer);
+    }
+    else
+    {
+        apply = g_new0 (apply_t, 1);
+        apply->key = g_strdup (key);
+        apply->first = g_get_monotonic_time ();
+        g_hash_table_insert (apply_pending, apply->key, apply);
+    }
+    apply->func = func;
+    apply->data = data;
+    apply->free_data = free_data;
+
+    /* wait for the quiet period, but not beyond the maximum delay since the first post */
+    delay = quiet_ms;
+    if (max_ms > 0)
+    {
+        remaining = max_ms - (g_get_monotonic_time () - apply->first) / 1000;
+        if (remaining < delay) delay = remaining > 0 ? remaining : 0;
+    }
+    apply->timer = g_timeout_add (delay, apply_timeout, apply);
+}
+
+void flush_applies (void)
+{
+    GHashTableIter iter;
+    gpointer apply;
+
+    /* changes may post further changes, so keep going until there are none */
+    while (apply_pending && g_hash_table_size (apply_pending))
+    {
+        g_hash_table_iter_init (&iter, apply_pending);
+        g_hash_table_iter_next (&iter, NULL, &apply);
+        apply_run ((apply_t *) apply);
+    }
+}
+
+/*----------------------------------------------------------------------------*/
+/* Privileged changes */
+/*----------------------------------------------------------------------------*/
+
+/* Changes which need root - files written in place of the user's own and commands run as
+ * root - are queued by plugins, and applied together by a single sudo invocation when the
+ * window is closed, or when a plugin calls apply_privileged. A later write to a file
+ * replaces any earlier one queued for it. Changes which need a reboot carry a reason,
+ * and the reasons for all changes which were applied are listed in the reboot prompt. */
+
+static void priv_free (priv_op_t *op)
+{
+    if (op->tmp)
     {
-        name = tab_name (tab);
-        label = gtk_label_new (name);
-
-        icon = gtk_image_new ();
-        gtk_widget_set_name (icon, icon_name (tab));
-        pixbuf = gtk_icon_theme_load_icon_for_scale (gtk_icon_theme_get_default (), gtk_widget_get_name (icon), font_height < 12 ? 24 : 32, scale, GTK_ICON_LOOKUP_FORCE_SIZE, NULL);
-        if (pixbuf)
-        {
-            if (scale == 1) gtk_image_set_from_pixbuf (GTK_IMAGE (icon), pixbuf);
-            else
-            {
-                cairo_surface_t *cr = gdk_cairo_surface_create_from_pixbuf (pixbuf, scale, NULL);
-                gtk_image_set_from_surface (GTK_IMAGE (icon), cr);
-                cairo_surface_destroy (cr);
-            }
-            g_object_unref (pixbuf);
-        }
+        unlink (op->tmp);
+        g_free (op->tmp);
+    }
+    g_free (op->path);
+    g_free (op->contents);
+    g_strfreev (op->argv);
+    g_free (op->reason);
+    g_free (op);
+}
 
-        box = gtk_box_new (GTK_ORIENTATION_HORIZONTAL, 5);
-        gtk_box_pack_start (GTK_BOX (box), icon, FALSE, FALSE, 0);
-        gtk_box_pack_start (GTK_BOX (box), label, FALSE, FALSE, 0);
-        gtk_widget_show_all (box);
+/* Called with priv_lock held */
+static void priv_add (priv_op_t *op)
+{
+    priv_op_t *old;
+    GList *l;
 
-        page = get_tab (tab);
-        for (count = 0; count < gtk_notebook_get_n_pages (GTK_NOTEBOOK (nb)); count++)
-        {
-            GList *list = gtk_container_get_children (GTK_CONTAINER (gtk_notebook_get_tab_label (GTK_NOTEBOOK (nb), gtk_notebook_get_nth_page (GTK_NOTEBOOK (nb), count))));
-            tablabel = gtk_label_get_label (GTK_LABEL (g_list_last (list)->data));
-            g_list_free (list);
-            if (g_strcmp0 (tablabel, name) > 0) break;
-        }
-        gtk_notebook_insert_page (GTK_NOTEBOOK (nb), page, box, count);
-        gtk_notebook_set_menu_label_text (GTK_NOTEBOOK (nb), page, name);
-        if (st_tab)
-        {
-            if (!g_strcmp0 (st_tab, tab_id (tab)))
-            {
-                gtk_notebook_set_current_page (GTK_NOTEBOOK (nb), count);
-                tab_set = TRUE;
-            }
-            else if (!g_strcmp0 (st_tab, "wifi_country") && !g_strcmp0 (tab_id (tab), "localisation"))
-            {
-                gtk_notebook_set_current_page (GTK_NOTEBOOK (nb), count);
-                tab_set = TRUE;
-                wifi_ctry = TRUE;
-            }
-        }
+    for (l = priv_ops; l && op->path; l = l->next)
+    {
+        old = (priv_op_t *) l->data;
+        if (g_strcmp0 (old->path, op->path)) continue;
+
+        /* the file may still differ from what is on disk in the way which needed a reboot */
+        if (!op->reason) op->reason = g_strdup (old->reason);
+        priv_ops = g_list_delete_link (priv_ops, l);
+        priv_free (old);
+        break;
     }
+    priv_ops = g_list_append (priv_ops, op);
+}
 
-    plugin_handles = g_list_append (plugin_handles, phandle);
+static void priv_queue (priv_op_t *op)
+{
+    g_mutex_lock (&priv_lock);
+    priv_add (op);
+    g_mutex_unlock (&priv_lock);
 }
 
-static void free_plugins (void *phandle, gpointer)
+static void priv_append (GString *script, const char * const *argv)
 {
-    free_plugin = dlsym (phandle, "free_plugin");
-    free_plugin ();
-    dlclose (phandle);
+    char *quoted;
+    int i;
+
+    for (i = 0; argv[i]; i++)
+    {
+        quoted = g_shell_quote (argv[i]);
+        g_string_append_printf (script, "%s%s", i ? " " : "", quoted);
+        g_free (quoted);
+    }
+    g_string_append_c (script, '\n');
 }
 
-static void call_func (void *phandle, gpointer data)
+void queue_privileged_write (const char *path, const char *contents, int len, const char *reason)
 {
-    void (*func) (void) = dlsym (phandle, (char *) data);
-    if (func) func ();
+    priv_op_t *op = g_new0 (priv_op_t, 1);
+
+    op->path = g_strdup (path);
+    op->len = len < 0 ? strlen (contents) : (gsize) len;
+    op->contents = g_memdup2 (contents, op->len);
+    op->reason = g_strdup (reason);
+    priv_queue (op);
 }
 
-void call_plugin_func (char *name)
+void queue_privileged_command (const char * const *argv, const char *reason)
 {
-    g_list_foreach (plugin_handles, call_func, name);
+    priv_op_t *op = g_new0 (priv_op_t, 1);
+
+    op->argv = g_strdupv ((char **) argv);
+    op->reason = g_strdup (reason);
+    priv_queue (op);
 }
 
-const char *dgetfixt (const char *domain, const char *msgctxid)
+/* The contents of a file are written to a temporary file which only the user can read */
+static gboolean priv_write_tmp (priv_op_t *op)
 {
-    const char *text = dgettext (domain, msgctxid);
-    if (g_strcmp0 (msgctxid, text)) return text;
-    return strchr (msgctxid, 0x04) + 1;
+    const char *buf = op->contents;
+    gsize left = op->len;
+    ssize_t done;
+    int fd;
+
+    fd = g_file_open_tmp ("rpcc-XXXXXX", &op->tmp, NULL);
+    if (fd < 0) return FALSE;
+    while (left)
+    {
+        done = write (fd, buf, left);
+        if (done < 0 && errno == EINTR) continue;
+        if (done <= 0) break;
+        buf += done;
+        left -= done;
+    }
+    close (fd);
+    return !left;
 }
 
-static void update_icons (GtkWidget *, gpointer)
+gboolean apply_privileged (void)
 {
-    GtkWidget *icon;
-    GdkPixbuf *pixbuf;
-    int count, font_height;
-    PangoFontDescription *font_desc;
-    GtkStyleContext *sc;
-    GList *list;
-    int scale;
+    const char *argv[] = { "sudo", "sh", "-c", NULL, NULL };
+    GString *copy, *commit, *run, *staged;
+    GList *ops, *failed, *newer, *l;
+    priv_op_t *op;
+    char *script, *output, *quoted, *mark;
+    gboolean res = TRUE, committed = FALSE, done;
+    gint64 start;
+    int file = 0, ran = 0;
+
+    /* configuration files which need root are only written out now */
+    priv_flush = TRUE;
+    config_file_flush ();
+    priv_flush = FALSE;
+
+    g_mutex_lock (&priv_lock);
+    ops = priv_ops;
+    priv_ops = NULL;
+    g_mutex_unlock (&priv_lock);
+    if (!ops) return TRUE;
+
+    start = trace_begin ();
+    set_watch_cursor ();
+
+    /* every new file is copied alongside the one it replaces, which is found through any
+     * symlinks, and given its owner and mode, before any is renamed into place - so if one
+     * cannot be written none is changed; commands are run afterwards, in the order in which
+     * they were queued, and the first which fails stops the rest */
+    copy = g_string_new (NULL);
+    commit = g_string_new (NULL);
+    run = g_string_new (NULL);
+    staged = g_string_new ("rm -f --");
+    for (l = ops; l && res; l = l->next)
+    {
+        op = (priv_op_t *) l->data;
+        if (!op->path) continue;
 
-    sc = gtk_widget_get_style_context (nb);
-    gtk_style_context_get (sc, gtk_style_context_get_state (sc), GTK_STYLE_PROPERTY_FONT, &font_desc, NULL);
-    font_height = pango_font_description_get_size (font_desc) / PANGO_SCALE;
-    pango_font_description_free (font_desc);
-    scale = gtk_widget_get_scale_factor (dlg);
+        if (!priv_write_tmp (op))
+        {
+            fprintf (stderr, "Unable to write temporary file for %s\n", op->path);
+            res = FALSE;
+            break;
+        }
+
+        file++;
+        quoted = g_shell_quote (op->path);
+        g_string_append_printf (copy, "f%d=$(readlink -f -- %s)\n", file, quoted);
+        g_free (quoted);
+        quoted = g_shell_quote (op->tmp);
+        g_string_append_printf (copy, "cp -- %s \"$f%d.rpcc-new\"\n", quoted, file);
+        g_free (quoted);
+        g_string_append_printf (copy, "if [ -e \"$f%d\" ] ; then chown --reference=\"$f%d\" -- \"$f%d.rpcc-new\" ; "
+            "chmod --reference=\"$f%d\" -- \"$f%d.rpcc-new\" ; else chmod 644 -- \"$f%d.rpcc-new\" ; fi\n",
+            file, file, file, file, file, file);
+        g_string_append_printf (commit, "mv -- \"$f%d.rpcc-new\" \"$f%d\"\n", file, file);
+        g_string_append_printf (staged, " ${f%d:+\"$f%d.rpcc-new\"}", file, file);
+    }
 
-    for (count = 0; count < gtk_notebook_get_n_pages (GTK_NOTEBOOK (nb)); count++)
+    if (res)
     {
-        list = gtk_container_get_children (GTK_CONTAINER (gtk_notebook_get_tab_label (GTK_NOTEBOOK (nb), gtk_notebook_get_nth_page (GTK_NOTEBOOK (nb), count))));
-        icon = GTK_WIDGET (g_list_first (list)->data);
-        g_list_free (list);
+        for (l = ops; l; l = l->next)
+        {
+            op = (priv_op_t *) l->data;
+            if (!op->argv) continue;
+            priv_append (run, (const char * const *) op->argv);
+            g_string_append (run, "echo " PRIV_RAN "\n");
+        }
+
+        /* any new file left behind by a failure is removed on exit */
+        quoted = g_shell_quote (staged->str);
+        script = g_strdup_printf ("trap %s EXIT\nset -e\n%s%strap - EXIT\necho " PRIV_COMMITTED "\n%s",
+            quoted, copy->str, commit->str, run->str);
+        g_free (quoted);
 
-        pixbuf = gtk_icon_theme_load_icon_for_scale (gtk_icon_theme_get_default (), gtk_widget_get_name (icon), font_height < 12 ? 24 : 32, scale, GTK_ICON_LOOKUP_FORCE_SIZE, NULL);
-        if (pixbuf)
+        argv[3] = script;
+        if (!cmd_output (argv, &output))
+        {
+            committed = TRUE;
+            ran = G_MAXINT;
+        }
+        else
         {
-            if (scale == 1) gtk_image_set_from_pixbuf (GTK_IMAGE (icon), pixbuf);
-            else
+            fprintf (stderr, "Unable to apply privileged changes - %s\n", output ? output : "");
+            res = FALSE;
+
+            /* find how far the script got, as the files may be in place even if a command failed */
+            if (output)
             {
-                cairo_surface_t *cr = gdk_cairo_surface_create_from_pixbuf (pixbuf, scale, NULL);
-                gtk_image_set_from_surface (GTK_IMAGE (icon), cr);
-                cairo_surface_destroy (cr);
+                committed = strstr (output, PRIV_COMMITTED) != NULL;
+                for (mark = output; (mark = strstr (mark, PRIV_RAN)); mark += strlen (PRIV_RAN)) ran++;
             }
-            g_object_unref (pixbuf);
         }
+        g_free (output);
+        g_free (script);
+        invalidate_command_cache ();
+    }
+
+    /* the changes which were made are done with, and their reasons kept for the reboot prompt */
+    if (!priv_reasons) priv_reasons = g_ptr_array_new_with_free_func (g_free);
+    failed = NULL;
+    for (l = ops; l; l = l->next)
+    {
+        op = (priv_op_t *) l->data;
+        if (op->path) done = committed;
+        else if ((done = ran > 0)) ran--;
+
+        if (!done)
+        {
+            if (op->tmp) unlink (op->tmp);
+            g_free (op->tmp);
+            op->tmp = NULL;
+            failed = g_list_append (failed, op);
+            continue;
+        }
+        if (op->reason && !g_ptr_array_find_with_equal_func (priv_reasons, op->reason, g_str_equal, NULL))
+            g_ptr_array_add (priv_reasons, g_strdup (op->reason));
+        priv_free (op);
+    }
+    g_list_free (ops);
+
+    /* the edits to configuration files are only dropped once they are safely on disk */
+    if (committed)
+    {
+        g_mutex_lock (&conf_lock);
+        if (conf_files) g_hash_table_foreach (conf_files, conf_applied, NULL);
+        g_mutex_unlock (&conf_lock);
+    }
+
+    /* put the rest back in front of any queued since, so that they can be tried again */
+    if (failed)
+    {
+        g_mutex_lock (&priv_lock);
+        newer = priv_ops;
+        priv_ops = failed;
+        for (l = newer; l; l = l->next) priv_add (l->data);
+        g_list_free (newer);
+        g_mutex_unlock (&priv_lock);
     }
+
+    g_string_free (copy, TRUE);
+    g_string_free (commit, TRUE);
+    g_string_free (run, TRUE);
+    g_string_free (staged, TRUE);
+    clear_watch_cursor ();
+    trace_end ("apply_privileged", NULL, start);
+    return res;
 }
 
 /*----------------------------------------------------------------------------*/
@@ -275,11 +2918,13 @@ static void update_icons (GtkWidget *, gpointer)
 
 void set_watch_cursor (void)
 {
+    if (!dlg) return;
     gdk_window_set_cursor (gtk_widget_get_window (dlg), watch);
 }
 
 void clear_watch_cursor (void)
 {
+    if (!dlg) return;
     gdk_window_set_cursor (gtk_widget_get_window (dlg), NULL);
 }
 
@@ -287,39 +2932,125 @@ void clear_watch_cursor (void)
 /* Reboot prompt */
 /*----------------------------------------------------------------------------*/
 
-static void reboot_check (void *phandle, gpointer)
+static void reboot_check (gpointer data, gpointer)
 {
-    reboot_needed = dlsym (phandle, "reboot_needed");
-    if (reboot_needed ()) reboot = TRUE;
+    plugin_t *plugin = (plugin_t *) data;
+    gint64 start;
+
+    if (!plugin->phandle) return;
+    start = trace_begin ();
+    if (plugin->desc.reboot_needed ()) reboot = TRUE;
+    trace_end ("reboot_check", plugin->path, start);
 }
 
 static void close_with_prompt (void)
 {
-    save_config ();
-    g_list_foreach (plugin_handles, reboot_check, NULL);
+    static gboolean closing = FALSE;
+    gboolean applied;
+    GtkWidget *wid;
+    gint64 start;
+    GString *reasons;
+    char *msg;
+    guint i;
 
-    gtk_widget_destroy (dlg);
-    if (reboot)
+    /* waiting for commands to finish runs the main loop, so the window could be closed again */
+    if (closing) return;
+    closing = TRUE;
+    start = trace_begin ();
+
+    save_config ();
+    cmd_finish_all ();
+    flush_applies ();
+    applied = apply_privileged ();
+    reboot = priv_reasons && priv_reasons->len;
+    if (applied) g_list_foreach (plugins, reboot_check, NULL);
+
+    /* plugins of a resident window may keep running commands while it is hidden, and the
+     * window stays open if changes could not be applied, so queue commands again */
+    if (resident || !applied)
     {
-        GtkWidget *wid;
+        g_object_unref (cmd_cancel);
+        cmd_cancel = g_cancellable_new ();
+    }
 
-        // the plugins need to use their own textdomain to load translations for builders, so set it back here
+    /* the changes are kept, so that they are tried again when the window is next closed */
+    if (!applied)
+    {
         textdomain (GETTEXT_PACKAGE);
+        gtk_window_set_transient_for (GTK_WINDOW (msg_dlg), GTK_WINDOW (dlg));
+
+        wid = (GtkWidget *) gtk_builder_get_object (builder, "modal_msg");
+        gtk_label_set_text (GTK_LABEL (wid), _("Some of the changes you have made could not be applied, as they need administrator rights.\n\nClose the window again to retry, or discard the changes to close it now."));
+
+        wid = (GtkWidget *) gtk_builder_get_object (builder, "modal_cancel");
+        gtk_button_set_label (GTK_BUTTON (wid), _("_Discard"));
+        g_signal_handlers_disconnect_by_func (wid, G_CALLBACK (close_app), NULL);
+        g_signal_handlers_disconnect_by_func (wid, G_CALLBACK (close_discard), NULL);
+        g_signal_connect (wid, "clicked", G_CALLBACK (close_discard), NULL);
+        gtk_widget_show (wid);
+
+        wid = (GtkWidget *) gtk_builder_get_object (builder, "modal_ok");
+        gtk_button_set_label (GTK_BUTTON (wid), _("_OK"));
+        g_signal_handlers_disconnect_by_func (wid, G_CALLBACK (close_app_reboot), NULL);
+        g_signal_handlers_disconnect_by_func (wid, G_CALLBACK (close_msg), NULL);
+        g_signal_connect (wid, "clicked", G_CALLBACK (close_msg), NULL);
+        gtk_widget_show (wid);
+
+        wid = (GtkWidget *) gtk_builder_get_object (builder, "modal_buttons");
+        gtk_widget_show (wid);
 
-        GtkBuilder *builder = gtk_builder_new_from_file (PACKAGE_DATA_DIR "/ui/rpcc.ui");
+        gtk_widget_show (msg_dlg);
+        trace_end ("close_with_prompt", NULL, start);
+        closing = FALSE;
+        return;
+    }
 
-        msg_dlg = (GtkWidget *) gtk_builder_get_object (builder, "modal");
+    gtk_window_set_transient_for (GTK_WINDOW (msg_dlg), NULL);
+    if (resident)
+    {
+        /* keep the window and the plugins for the next time the application is opened */
+        gtk_widget_hide (dlg);
+        mark_tab_shown (gtk_notebook_get_nth_page (GTK_NOTEBOOK (nb), gtk_notebook_get_current_page (GTK_NOTEBOOK (nb))));
+    }
+    else
+    {
+        ready = FALSE;
+        stop_loading ();
+        g_cancellable_cancel (icon_cancel);
+        if (hibernate_id) g_source_remove (hibernate_id);
+        hibernate_id = 0;
+        gtk_widget_destroy (dlg);
+    }
+    if (reboot)
+    {
+        // the plugins need to use their own textdomain to load translations, so set it back here
+        textdomain (GETTEXT_PACKAGE);
 
         wid = (GtkWidget *) gtk_builder_get_object (builder, "modal_msg");
-        gtk_label_set_text (GTK_LABEL (wid), _("The changes you have made require the Raspberry Pi to be rebooted to take effect.\n\nWould you like to reboot now? "));
+        if (priv_reasons && priv_reasons->len)
+        {
+            reasons = g_string_new (NULL);
+            for (i = 0; i < priv_reasons->len; i++)
+                g_string_append_printf (reasons, "\n%s", (char *) g_ptr_array_index (priv_reasons, i));
+            msg = g_strdup_printf (_("The following changes require the Raspberry Pi to be rebooted to take effect:\n%s\n\nWould you like to reboot now? "), reasons->str);
+            gtk_label_set_text (GTK_LABEL (wid), msg);
+            g_string_free (reasons, TRUE);
+            g_free (msg);
+            g_ptr_array_set_size (priv_reasons, 0);
+        }
+        else gtk_label_set_text (GTK_LABEL (wid), _("The changes you have made require the Raspberry Pi to be rebooted to take effect.\n\nWould you like to reboot now? "));
 
         wid = (GtkWidget *) gtk_builder_get_object (builder, "modal_cancel");
         gtk_button_set_label (GTK_BUTTON (wid), _("_No"));
+        g_signal_handlers_disconnect_by_func (wid, G_CALLBACK (close_discard), NULL);
+        g_signal_handlers_disconnect_by_func (wid, G_CALLBACK (close_app), NULL);
         g_signal_connect (wid, "clicked", G_CALLBACK (close_app), NULL);
         gtk_widget_show (wid);
 
         wid = (GtkWidget *) gtk_builder_get_object (builder, "modal_ok");
         gtk_button_set_label (GTK_BUTTON (wid), _("_Yes"));
+        g_signal_handlers_disconnect_by_func (wid, G_CALLBACK (close_msg), NULL);
+        g_signal_handlers_disconnect_by_func (wid, G_CALLBACK (close_app_reboot), NULL);
         g_signal_connect (wid, "clicked", G_CALLBACK (close_app_reboot), NULL);
         gtk_widget_show (wid);
 
@@ -327,45 +3058,57 @@ static void close_with_prompt (void)
         gtk_widget_show (wid);
 
         gtk_widget_show (msg_dlg);
-
-        g_object_unref (builder);
     }
-    else gtk_main_quit ();
+    else if (!resident) g_application_quit (G_APPLICATION (app));
+
+    trace_end ("close_with_prompt", NULL, start);
+    closing = FALSE;
 }
 
 static gboolean close_app (GtkButton *button, gpointer)
 {
-    gtk_widget_destroy (msg_dlg);
-    gtk_main_quit ();
+    if (resident) gtk_widget_hide (msg_dlg);
+    else
+    {
+        gtk_widget_destroy (msg_dlg);
+        g_application_quit (G_APPLICATION (app));
+    }
     return FALSE;
 }
 
-static gboolean close_app_reboot (GtkButton *button, gpointer)
+static gboolean close_msg (GtkButton *button, gpointer)
 {
-    gtk_widget_destroy (msg_dlg);
-    gtk_main_quit ();
-    system ("/usr/sbin/reboot");
+    gtk_widget_hide (msg_dlg);
     return FALSE;
 }
 
-/*----------------------------------------------------------------------------*/
-/* Message box */
-/*----------------------------------------------------------------------------*/
+/* Drops the changes which could not be applied, and closes as if they had been */
 
-static void message (char *msg)
+static gboolean close_discard (GtkButton *button, gpointer)
 {
-    GtkWidget *wid;
-    GtkBuilder *builder = gtk_builder_new_from_file (PACKAGE_DATA_DIR "/ui/rpcc.ui");
+    GList *ops;
 
-    msg_dlg = (GtkWidget *) gtk_builder_get_object (builder, "modal");
-    if (dlg) gtk_window_set_transient_for (GTK_WINDOW (msg_dlg), GTK_WINDOW (dlg));
+    g_mutex_lock (&priv_lock);
+    ops = priv_ops;
+    priv_ops = NULL;
+    g_mutex_unlock (&priv_lock);
+    g_list_free_full (ops, (GDestroyNotify) priv_free);
 
-    wid = (GtkWidget *) gtk_builder_get_object (builder, "modal_msg");
-    gtk_label_set_text (GTK_LABEL (wid), msg);
+    g_mutex_lock (&conf_lock);
+    if (conf_files) g_hash_table_foreach (conf_files, conf_discard, NULL);
+    g_mutex_unlock (&conf_lock);
 
-    gtk_widget_show (msg_dlg);
+    gtk_widget_hide (msg_dlg);
+    close_with_prompt ();
+    return FALSE;
+}
 
-    g_object_unref (builder);
+static gboolean close_app_reboot (GtkButton *button, gpointer)
+{
+    gtk_widget_destroy (msg_dlg);
+    g_application_quit (G_APPLICATION (app));
+    system ("/usr/sbin/reboot");
+    return FALSE;
 }
 
 /*----------------------------------------------------------------------------*/
@@ -386,9 +3129,16 @@ static gboolean close_prog (GtkWidget *widget, GdkEvent *event, gpointer data)
 
 static gboolean scroll (GtkWidget *, GdkEventScroll *ev, gpointer)
 {
+    GtkWidget *wid;
+    GtkAllocation alloc;
     int page;
 
-    if (ev->x < tabs_x)
+    /* find the x position of the pages - anything to the left is tabs... */
+    wid = gtk_notebook_get_nth_page (GTK_NOTEBOOK (nb), gtk_notebook_get_current_page (GTK_NOTEBOOK (nb)));
+    if (!wid) return FALSE;
+    gtk_widget_get_allocation (wid, &alloc);
+
+    if (ev->x < alloc.x)
     {
         page = gtk_notebook_get_current_page (GTK_NOTEBOOK (nb));
         if (ev->direction == 0 && page > 0) page--;
@@ -431,6 +3181,10 @@ static void load_config (int *w, int *h, int *tab)
         val = g_key_file_get_integer (kf, "*", "tab", &err);
         if (err == NULL) *tab = val;
         else *tab = 0;
+
+        err = NULL;
+        val = g_key_file_get_integer (kf, "*", "hibernate", &err);
+        if (err == NULL) hibernate_secs = val;
     }
 
     g_key_file_free (kf);
@@ -470,72 +3224,317 @@ static void save_config (void)
 /* Startup */
 /*----------------------------------------------------------------------------*/
 
-static gboolean init_window (gpointer)
+static void init_window (void)
 {
-    GtkBuilder *builder;
     GdkWindow *win;
     GtkWidget *wid;
-    DIR *d;
-    struct dirent *dir;
-    int w, h, tab;
-
-    /* create the dialog */
-    builder = gtk_builder_new_from_file (PACKAGE_DATA_DIR "/ui/rpcc.ui");
+    int w, h;
+    gint64 start;
 
-    dlg = (GtkWidget *) gtk_builder_get_object (builder, "dlg");
-    nb = (GtkWidget *) gtk_builder_get_object (builder, "notebook");
+    start = trace_begin ();
 
-    load_config (&w, &h, &tab);
+    /* set up the dialog */
+    load_config (&w, &h, &saved_tab);
     gtk_window_set_default_size (GTK_WINDOW (dlg), w, h);
 
     g_signal_connect (dlg, "delete_event", G_CALLBACK (close_prog), NULL);
     g_signal_connect (dlg, "scroll-event", G_CALLBACK (scroll), NULL);
+    if (trace_buf) g_signal_connect_after (dlg, "draw", G_CALLBACK (trace_frame), NULL);
 
     wid = (GtkWidget *) gtk_builder_get_object (builder, "btn_close");
     g_signal_connect (wid, "clicked", G_CALLBACK (ok_main), NULL);
     gtk_widget_grab_focus (wid);
 
-    g_object_unref (builder);
+    /* add the cached tabs now - plugins which need loading are then loaded in the background */
+    tabs = g_ptr_array_new_with_free_func (free_tab);
+    icon_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) cairo_surface_destroy);
+    icon_cancel = g_cancellable_new ();
+    update_icons (NULL, NULL);
+    scan_plugins ();
 
-    /* loop thorough plugins */
-    if ((d = opendir (PLUGIN_PATH)))
+    /* the saved tab number is only meaningful once all the tabs are there */
+    tab_set = select_tab (st_tab);
+    if (!tab_set && !load_queue.length)
     {
-        while ((dir = readdir (d)))
-        {
-            load_plugin (nb, dir->d_name);
-        }
+        gtk_notebook_set_current_page (GTK_NOTEBOOK (nb), saved_tab);
+        saved_tab = -1;
     }
-    closedir (d);
 
-    if (!tab_set) gtk_notebook_set_current_page (GTK_NOTEBOOK (nb), tab);
+    /* only the page being shown is built now - the rest are built when first selected */
+    wid = gtk_notebook_get_nth_page (GTK_NOTEBOOK (nb), gtk_notebook_get_current_page (GTK_NOTEBOOK (nb)));
+    if (wid) build_tab (wid);
+    g_signal_connect (nb, "switch-page", G_CALLBACK (switch_page), NULL);
+
+    g_signal_connect_after (dlg, "map-event", G_CALLBACK (window_state), NULL);
+    g_signal_connect_after (dlg, "unmap-event", G_CALLBACK (window_state), NULL);
+    g_signal_connect_after (dlg, "window-state-event", G_CALLBACK (window_state), NULL);
+    g_signal_connect (dlg, "notify::is-active", G_CALLBACK (window_active), NULL);
 
     gtk_widget_show (dlg);
-    gtk_widget_destroy (msg_dlg);
     win = gtk_widget_get_window (dlg);
     gdk_window_set_events (win, gdk_window_get_events (win) | GDK_SCROLL_MASK);
 
-    /* find the x position of the child widgets - anything to the left is tabs... */
-    GList *l = gtk_container_get_children (GTK_CONTAINER (nb));
-    if (l)
+    if (wifi_ctry) call_plugin_func ("on_set_wifi");
+    g_signal_connect (nb, "style-updated", G_CALLBACK (update_icons), NULL);
+    if (hibernate_secs > 0) hibernate_id = g_timeout_add_seconds (MAX (hibernate_secs / 2, 1), hibernate_check, NULL);
+    ready = TRUE;
+
+    trace_end ("init_window", NULL, start);
+}
+
+/* Called when the application is opened again while it is already running */
+
+static void show_window (void)
+{
+    GtkWidget *page;
+
+    wifi_ctry = FALSE;
+    tab_set = select_tab (st_tab);
+
+    /* the page left showing may have been released while the window was hidden */
+    page = gtk_notebook_get_nth_page (GTK_NOTEBOOK (nb), gtk_notebook_get_current_page (GTK_NOTEBOOK (nb)));
+    if (page) build_tab (page);
+    gtk_widget_show (dlg);
+    gtk_window_present (GTK_WINDOW (dlg));
+    if (wifi_ctry) call_plugin_func ("on_set_wifi");
+}
+
+static gboolean terminate (gpointer)
+{
+    g_application_quit (G_APPLICATION (app));
+    return G_SOURCE_REMOVE;
+}
+
+/*----------------------------------------------------------------------------*/
+/* Application */
+/*----------------------------------------------------------------------------*/
+
+/* rpcc runs as a single instance - starting it again while it is running passes the
+ * command line to the running instance, which shows the window and the requested tab */
+
+static void app_startup (GApplication *, gpointer)
+{
+    gint64 start, app_start;
+
+    /* GTK has been initialised and the application registered on the session bus */
+    trace_end ("gtk_init", NULL, run_start);
+    app_start = trace_begin ();
+
+    /* windows are not added to the application, so keep it running until quit */
+    g_application_hold (G_APPLICATION (app));
+
+    /* exit cleanly on SIGTERM so that plugins are freed and any trace is written */
+    g_unix_signal_add (SIGTERM, terminate, NULL);
+    if (mem_report) g_unix_signal_add (SIGUSR1, mem_signal, NULL);
+    watchdog_start ();
+
+    watch = gdk_cursor_new_for_display (gdk_display_get_default (), GDK_WATCH);
+    cmd_cancel = g_cancellable_new ();
+
+    /* the UI is compiled in as a resource, and parsed once for all the windows */
+    start = trace_begin ();
+    builder = gtk_builder_new_from_resource ("/com/raspberrypi/rpcc/ui/rpcc.ui");
+    trace_end ("gtk_builder_new_from_resource", NULL, start);
+
+    dlg = (GtkWidget *) gtk_builder_get_object (builder, "dlg");
+    nb = (GtkWidget *) gtk_builder_get_object (builder, "notebook");
+    msg_dlg = (GtkWidget *) gtk_builder_get_object (builder, "modal");
+    trace_end ("app_startup", NULL, app_start);
+}
+
+static int app_command_line (GApplication *, GApplicationCommandLine *cmdline, gpointer)
+{
+    GVariantDict *options;
+    gboolean val;
+    char **argv;
+    int argc;
+
+    options = g_application_command_line_get_options_dict (cmdline);
+    if (g_variant_dict_lookup (options, "resident", "b", &val) && val) resident = TRUE;
+
+    argv = g_application_command_line_get_arguments (cmdline, &argc);
+    g_free (st_tab);
+    if (argc > 1) st_tab = g_strdup (argv[1]);
+    else st_tab = NULL;
+    g_strfreev (argv);
+
+    if (!started)
     {
-        GtkAllocation alloc;
-        gtk_widget_get_allocation (GTK_WIDGET (g_list_nth_data (l, 0)), &alloc);
-        tabs_x = alloc.x;
-        g_list_free (l);
+        started = TRUE;
+        init_window ();
     }
-    else tabs_x = 0;
+    else if (ready) show_window ();
 
-    if (wifi_ctry) call_plugin_func ("on_set_wifi");
-    g_signal_connect (nb, "style-updated", G_CALLBACK (update_icons), NULL);
+    return 0;
+}
 
-    return FALSE;
+/*----------------------------------------------------------------------------*/
+/* Headless mode */
+/*----------------------------------------------------------------------------*/
+
+/* "rpcc --list", "--get <id>" and "--set <id>=<value>" read and change the settings of
+ * plugins which provide them without initialising GTK. Only prefetch_plugin and the
+ * settings functions of each plugin are called. The exit code is 0 on success, 1 if any
+ * setting could not be read or changed, and 2 if a reboot is needed. */
+
+static gboolean headless_arg (const char *arg)
+{
+    return !g_strcmp0 (arg, "--list") || !g_strcmp0 (arg, "--get") || !g_strcmp0 (arg, "--set")
+        || g_str_has_prefix (arg, "--get=") || g_str_has_prefix (arg, "--set=");
 }
 
-static gboolean draw (GtkWidget *wid, cairo_t *cr, gpointer data)
+static void headless_open (char *path, const rpcc_plugin_t *(*builtin) (void))
 {
-    g_signal_handler_disconnect (wid, draw_id);
-    g_idle_add (init_window, NULL);
-    return FALSE;
+    plugin_t *plugin;
+
+    plugin = g_new0 (plugin_t, 1);
+    plugin->path = path;
+    plugin->builtin = builtin;
+    if (!open_plugin (plugin) || !plugin->desc.plugin_settings || !plugin->desc.get_setting || !plugin->desc.set_setting)
+    {
+        if (plugin->phandle) dlclose (plugin->phandle);
+        g_free (plugin->path);
+        g_free (plugin);
+        return;
+    }
+    if (plugin->desc.prefetch_plugin) run_prefetch (plugin);
+    plugins = g_list_append (plugins, plugin);
+}
+
+static void headless_load (void)
+{
+    DIR *d;
+    struct dirent *dir;
+    int i;
+
+    for (i = 0; builtin_plugins[i].name; i++)
+        headless_open (g_strconcat (BUILTIN_PREFIX, builtin_plugins[i].name, NULL), builtin_plugins[i].descriptor);
+
+    if (!(d = opendir (plugin_path))) return;
+    while ((dir = readdir (d)))
+    {
+        if (!strstr (dir->d_name, ".so") || is_builtin (dir->d_name, ".so")) continue;
+        headless_open (g_build_filename (plugin_path, dir->d_name, NULL), NULL);
+    }
+    closedir (d);
+}
+
+static plugin_t *find_setting (const char *id)
+{
+    const char * const *ids;
+    plugin_t *plugin;
+    GList *l;
+
+    for (l = plugins; l; l = l->next)
+    {
+        plugin = (plugin_t *) l->data;
+        ids = plugin->desc.plugin_settings ();
+        if (ids && g_strv_contains (ids, id)) return plugin;
+    }
+    fprintf (stderr, "Unknown setting '%s'\n", id);
+    return NULL;
+}
+
+static void print_setting (plugin_t *plugin, const char *id, gboolean with_id)
+{
+    char *val = plugin->desc.get_setting (id);
+
+    if (with_id) printf ("%s=%s\n", id, val ? val : "");
+    else printf ("%s\n", val ? val : "");
+    g_free (val);
+}
+
+static int headless_main (int argc, char *argv[])
+{
+    gboolean list = FALSE;
+    char **get = NULL, **set = NULL, **kv;
+    const char * const *ids;
+    GOptionEntry entries[] = {
+        { "list", 0, 0, G_OPTION_ARG_NONE, &list, N_("List all settings and their values"), NULL },
+        { "get", 0, 0, G_OPTION_ARG_STRING_ARRAY, &get, N_("Print the value of a setting"), N_("ID") },
+        { "set", 0, 0, G_OPTION_ARG_STRING_ARRAY, &set, N_("Change the value of a setting"), N_("ID=VALUE") },
+        { NULL }
+    };
+    GOptionContext *ctx;
+    GError *err = NULL;
+    GList *changed = NULL, *l;
+    plugin_t *plugin;
+    int i, res = 0;
+
+    ctx = g_option_context_new (NULL);
+    g_option_context_add_main_entries (ctx, entries, GETTEXT_PACKAGE);
+    if (!g_option_context_parse (ctx, &argc, &argv, &err))
+    {
+        fprintf (stderr, "%s\n", err->message);
+        g_error_free (err);
+        g_option_context_free (ctx);
+        return 1;
+    }
+    g_option_context_free (ctx);
+
+    /* there is no main loop, so commands started by plugins are run synchronously */
+    cmd_cancel = g_cancellable_new ();
+    g_cancellable_cancel (cmd_cancel);
+
+    headless_load ();
+
+    if (list)
+    {
+        for (l = plugins; l; l = l->next)
+        {
+            plugin = (plugin_t *) l->data;
+            for (ids = plugin->desc.plugin_settings (); ids && *ids; ids++) print_setting (plugin, *ids, TRUE);
+        }
+    }
+
+    for (i = 0; get && get[i]; i++)
+    {
+        if ((plugin = find_setting (get[i]))) print_setting (plugin, get[i], FALSE);
+        else res = 1;
+    }
+
+    for (i = 0; set && set[i]; i++)
+    {
+        kv = g_strsplit (set[i], "=", 2);
+        if (!kv[0] || !kv[1])
+        {
+            fprintf (stderr, "Expected ID=VALUE - '%s'\n", set[i]);
+            res = 1;
+        }
+        else if (!(plugin = find_setting (kv[0]))) res = 1;
+        else if (!plugin->desc.set_setting (kv[0], kv[1]))
+        {
+            fprintf (stderr, "Unable to set '%s' to '%s'\n", kv[0], kv[1]);
+            res = 1;
+        }
+        else if (!g_list_find (changed, plugin)) changed = g_list_append (changed, plugin);
+        g_strfreev (kv);
+    }
+
+    /* write any changes which plugins have deferred */
+    flush_applies ();
+    if (!apply_privileged ()) res = 1;
+    if (priv_reasons && priv_reasons->len && !res) res = 2;
+
+    for (l = changed; l; l = l->next)
+    {
+        plugin = (plugin_t *) l->data;
+        if (plugin->desc.reboot_needed () && !res) res = 2;
+    }
+    g_list_free (changed);
+
+    /* init_plugin was never called, so free_plugin is not either */
+    for (l = plugins; l; l = l->next)
+    {
+        plugin = (plugin_t *) l->data;
+        dlclose (plugin->phandle);
+        plugin->phandle = NULL;
+    }
+    g_list_foreach (plugins, free_plugins, NULL);
+
+    g_strfreev (get);
+    g_strfreev (set);
+    return res;
 }
 
 /*----------------------------------------------------------------------------*/
@@ -544,6 +3543,14 @@ static gboolean draw (GtkWidget *wid, cairo_t *cr, gpointer data)
 
 int main (int argc, char* argv[])
 {
+    GOptionEntry options[] = {
+        { "resident", 'r', 0, G_OPTION_ARG_NONE, NULL, N_("Keep running in the background when the window is closed"), NULL },
+        { NULL }
+    };
+    int i, res;
+
+    trace_init ();
+
     setlocale (LC_ALL, "");
     bindtextdomain (GETTEXT_PACKAGE, PACKAGE_LOCALE_DIR);
     bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");
@@ -556,23 +3563,61 @@ int main (int argc, char* argv[])
     }
     else wm = WM_OPENBOX;
 
-    if (argc > 1) st_tab = g_strdup (argv[1]);
-    else st_tab = NULL;
+    mem_report = getenv ("RPCC_MEM_REPORT") != NULL;
 
-    gtk_init (&argc, &argv);
+    /* allow an alternative plugin directory, for testing */
+    plugin_path = getenv ("RPCC_PLUGIN_PATH");
+    if (!plugin_path || !*plugin_path) plugin_path = PLUGIN_PATH;
 
-    watch = gdk_cursor_new_for_display (gdk_display_get_default (), GDK_WATCH);
+    /* warm the page cache with the plugins while GTK starts */
+    g_thread_unref (g_thread_new ("readahead", readahead_thread, NULL));
+
+    /* optionally resolve all of a plugin's symbols when it is opened, so the cost is seen in the trace */
+    bind_now = getenv ("RPCC_BIND_NOW") != NULL;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (headless_arg (argv[i]))
+        {
+            res = headless_main (argc, argv);
+            trace_write ();
+            return res;
+        }
+    }
 
-    /* show wait message */
-    message (_("Loading configuration - please wait..."));
-    draw_id = g_signal_connect (msg_dlg, "draw", G_CALLBACK (draw), NULL);
+    app = gtk_application_new ("com.raspberrypi.rpcc", G_APPLICATION_HANDLES_COMMAND_LINE);
+    g_application_add_main_option_entries (G_APPLICATION (app), options);
+    g_signal_connect (app, "startup", G_CALLBACK (app_startup), NULL);
+    g_signal_connect (app, "command-line", G_CALLBACK (app_command_line), NULL);
 
-    gtk_main ();
+    run_start = trace_begin ();
+    res = g_application_run (G_APPLICATION (app), argc, argv);
 
-    /* close the plugins cleanly */
-    g_list_foreach (plugin_handles, free_plugins, NULL);
+    /* if the window was never closed, as on SIGTERM, its changes have still to be applied -
+     * there is no one to ask about rebooting, so the need for one is only reported */
+    if (ready)
+    {
+        cmd_finish_all ();
+        flush_applies ();
+        if (apply_privileged ()) g_list_foreach (plugins, reboot_check, NULL);
+        else fprintf (stderr, "Some changes could not be applied\n");
+        if (reboot || (priv_reasons && priv_reasons->len)) fprintf (stderr, "A reboot is needed for the changes to take effect\n");
+    }
 
-    return 0;
+    watchdog_end ();
+
+    /* close the plugins cleanly */
+    stop_loading ();
+    g_list_foreach (plugins, close_plugin, NULL);
+    if (mem_report) mem_write ();
+    g_list_foreach (plugins, free_plugins, NULL);
+    if (tabs) g_ptr_array_free (tabs, TRUE);
+    if (event_table) g_hash_table_destroy (event_table);
+    if (builder) g_object_unref (builder);
+    g_object_unref (app);
+
+    trace_write ();
+    return res;
 }
 
 /* End of file */
@@ -25,14 +25,83 @@ ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
 SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 ============================================================================*/
 
+#include <gtk/gtk.h>
+
 /*----------------------------------------------------------------------------*/
 /* Typedefs and macros */
 /*----------------------------------------------------------------------------*/
 
+/* Plugin interface version 2 - a plugin exports "const rpcc_plugin_t *plugin_descriptor (void)"
+ * in place of the individual functions. Fields are only ever added at the end, and size tells
+ * rpcc how many of them the plugin was built with. */
+
+#define RPCC_ABI_VERSION 2
+
+#define RPCC_PLUGIN_LAZY_TABS           (1 << 0)
+#define RPCC_PLUGIN_THREADED_PREFETCH   (1 << 1)
+#define RPCC_PLUGIN_RELEASE_TAB         (1 << 2)
+
+typedef struct {
+    int abi_version;
+    size_t size;
+    unsigned int flags;
+    void (*init_plugin) (GtkWidget *parent);
+    int (*plugin_tabs) (void);
+    const char *(*tab_name) (int tab);
+    const char *(*tab_id) (int tab);
+    const char *(*icon_name) (int tab);
+    GtkWidget *(*get_tab) (int tab);
+    gboolean (*reboot_needed) (void);
+    void (*free_plugin) (void);
+    void (*prefetch_plugin) (void);
+    void (*release_tab) (int tab);
+    const char * const *(*plugin_settings) (void);
+    char *(*get_setting) (const char *id);
+    gboolean (*set_setting) (const char *id, const char *value);
+    void (*tab_visible) (int tab, gboolean visible);
+    void (*window_active) (gboolean active);
+} rpcc_plugin_t;
+
+typedef void (*command_callback) (int status, const char *output, void *data);
+typedef void (*apply_callback) (void *data);
+typedef GVariant *(*event_handler) (const char *event, GVariant *payload, void *data);
+
 /*----------------------------------------------------------------------------*/
 /* Global data */
 /*----------------------------------------------------------------------------*/
 
+/*----------------------------------------------------------------------------*/
+/* Functions exported to plugins */
+/*----------------------------------------------------------------------------*/
+
+extern void set_watch_cursor (void);
+extern void clear_watch_cursor (void);
+extern void call_plugin_func (char *name);
+extern const char *dgetfixt (const char *domain, const char *msgctxid);
+
+extern char *config_file_get (const char *path, const char *section, const char *key);
+extern void config_file_set (const char *path, const char *section, const char *key, const char *value);
+extern void config_file_flush (void);
+
+extern guint plugin_timeout_add (unsigned int interval, GSourceFunc func, void *data);
+
+extern void run_command_async (const char * const *argv, command_callback callback, void *data);
+
+extern char *run_command_cached (const char * const *argv, unsigned int ttl_ms, int *status);
+extern void invalidate_command_cache (void);
+
+extern void queue_privileged_write (const char *path, const char *contents, int len, const char *reason);
+extern void queue_privileged_command (const char * const *argv, const char *reason);
+extern gboolean apply_privileged (void);
+
+extern void schedule_apply (const char *key, apply_callback func, void *data, void (*free_data) (void *), int quiet_ms, int max_ms);
+extern void flush_applies (void);
+
+extern void subscribe_event (const char *event, event_handler handler, void *data);
+extern void unsubscribe_event (const char *event, event_handler handler, void *data);
+extern GVariant *emit_event (const char *event, GVariant *payload);
+extern void post_event (const char *event, GVariant *payload);
+
 /* End of file */
 /*============================================================================*/
 